@@ -46,7 +46,7 @@ class player : public virtual GravityEngine_Object
         int willjump_timer = 0;
         int sprite_index;
         double col_prec = 0.0125;
-        std::vector<int> collides_with = {1};
+        Uint8 collides_with = 1; // Collision bits the player cannot move through
         bounding_box collision_box = { 0, 0, 32, 40 };
 	public:
         player() 
@@ -120,28 +120,20 @@ class player : public virtual GravityEngine_Object
             double xv_t = xvel;
             double yv_t = yvel;
 
-            // Apply the y velocity
-            if (check_collision_solid(x + xv_t, y))
+            // Apply the x velocity - The sweep stops the box where it first touches a wall
+            collision_sweep sweep = geptr->SweepRect(x + collision_box.x / (double)geptr->GetFontW(), y + collision_box.y / (double)geptr->GetFontH(), collision_box.w / (double)geptr->GetFontW(), collision_box.h / (double)geptr->GetFontH(), xv_t, 0, collides_with);
+            if (sweep.hit)
             {
-                while (abs(xv_t) >= col_prec && !check_collision_solid(x + col_prec * (xv_t / abs(xv_t)), y))
-                {
-                    x += col_prec * (xv_t / abs(xv_t));
-                    xv_t = (abs(xv_t) - col_prec) * (xv_t / abs(xv_t));
-                }
-                xv_t = 0;
+                xv_t *= sweep.toi;
                 xvel = 0;
             }
             x += xv_t;
 
             // Apply the y velocity
-            if (check_collision_solid(x, y + yv_t))
+            sweep = geptr->SweepRect(x + collision_box.x / (double)geptr->GetFontW(), y + collision_box.y / (double)geptr->GetFontH(), collision_box.w / (double)geptr->GetFontW(), collision_box.h / (double)geptr->GetFontH(), 0, yv_t, collides_with);
+            if (sweep.hit)
             {
-                while (abs(yv_t) >= col_prec && !check_collision_solid(x, y + col_prec * (yv_t / abs(yv_t))))
-                {
-                    y += col_prec * (yv_t / abs(yv_t));
-                    yv_t = (abs(yv_t) - col_prec) * (yv_t / abs(yv_t));
-                }
-                yv_t = 0;
+                yv_t *= sweep.toi;
                 yvel = 0;
             }
             y += yv_t;
@@ -168,33 +160,8 @@ class player : public virtual GravityEngine_Object
 
         bool check_collision_solid(double x, double y)
         {
-            int x1 = floor((x * geptr->GetFontW() + collision_box.x) / geptr->GetFontW());
-            int y1 = floor((y * geptr->GetFontH() + collision_box.y) / geptr->GetFontH());
-            int x2 = floor(((x * geptr->GetFontW() + collision_box.x) + collision_box.w-1) / geptr->GetFontW());
-            int y2 = floor(((y * geptr->GetFontH() + collision_box.y) + collision_box.h-1) / geptr->GetFontH());
-
-            for (int q = y1; q <= y2; q++)
-            {
-                for (int i = x1; i <= x2; i++)
-                {
-                    int xx = i;
-                    int yy = q;
-                    if (xx >= geptr->GetCanvasW() * 2)
-                        xx -= geptr->GetCanvasW() * 2;
-                    if (xx < 0)
-                        xx += geptr->GetCanvasW() * 2;
-                    if (yy >= geptr->GetCanvasH() * 2)
-                        yy -= geptr->GetCanvasH() * 2;
-                    if (yy < 0)
-                        yy += geptr->GetCanvasH() * 2;
-
-                    if (VectorContains<int>(collides_with, geptr->GetCollisionValue(xx, yy, geptr->stat)) ||
-                        VectorContains<int>(collides_with, geptr->GetCollisionValue(xx, yy, geptr->dyn)))
-                        return true;
-                }
-            }
-
-            return false;
+            // The query wraps around the world on its own
+            return geptr->QueryBox(x + collision_box.x / (double)geptr->GetFontW(), y + collision_box.y / (double)geptr->GetFontH(), collision_box.w / (double)geptr->GetFontW(), collision_box.h / (double)geptr->GetFontH(), collides_with).any;
         }
 };
 
@@ -202,11 +169,16 @@ class player : public virtual GravityEngine_Object
 void GameInit()
 {
     int q = geptr->GetCanvasH() - 1;
+    // Paint the whole floor row in one upload
+    int pitch;
+    Uint32* floor_cells = geptr->LockLayerRegion(geptr->background, 0, q, geptr->GetCanvasW() * 2, 1, &pitch, true);
     for (int i = 0; i < geptr->GetCanvasW() * 2; i++)
     {
-        geptr->DrawRect(i * geptr->GetFontW(), q * geptr->GetFontH(), geptr->GetFontW(), geptr->GetFontH(), { 255,0,0,255 }, geptr->background);
+        if (floor_cells != nullptr)
+            floor_cells[i] = 0xFFFF0000;
         geptr->SetCollisionValue(i, q, geptr->stat, 1);
     }
+    geptr->UnlockLayerRegion();
 
     p = geptr->AddObject(new player());
 }
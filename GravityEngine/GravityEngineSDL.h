@@ -12,6 +12,22 @@
 #include <string>
 #include <unordered_map>
 #include <random>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <bit>
+#include <queue>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <numeric>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GRAVITY_SSE2
+#endif
 
 
 // Color struct (foreground and background)
@@ -23,6 +39,53 @@ struct color
     SDL_Color b;
 };
 
+// Result of a collision rect query
+// bool any : At least one cell matched
+// int first_x : Horizontal coordinate of the first matching cell (row by row from the top left of the rect, -1 if none)
+// int first_y : Vertical coordinate of the first matching cell (-1 if none)
+// int count : Number of matching cells (only counted past the first when asked to)
+struct collision_hit
+{
+    bool any = false;
+    int first_x = -1;
+    int first_y = -1;
+    int count = 0;
+};
+
+// Result of a raycast or swept box against the collision grid
+// bool hit : Something was hit before the end of the motion
+// double toi : Time of impact as a fraction of the motion (1 if nothing was hit)
+// int cell_x : Horizontal coordinate of the cell that was hit (-1 if none)
+// int cell_y : Vertical coordinate of the cell that was hit (-1 if none)
+// int normal_x : Horizontal direction of the surface that was hit (-1, 0 or 1)
+// int normal_y : Vertical direction of the surface that was hit (-1, 0 or 1)
+struct collision_sweep
+{
+    bool hit = false;
+    double toi = 1;
+    int cell_x = -1;
+    int cell_y = -1;
+    int normal_x = 0;
+    int normal_y = 0;
+};
+
+// Cells seen from an origin, filled by ComputeFOV and meant to be reused between calls
+// int origin_x : Horizontal coordinate of the origin
+// int origin_y : Vertical coordinate of the origin
+// int radius : Sight radius in cells (-1 until computed)
+// int side : Cells per row of the window around the origin (radius * 2 + 1)
+// int words : 64-bit words per row of bits
+// std::vector<Uint64> bits : One bit per cell of the window, row by row from the top left
+struct fov_map
+{
+    int origin_x = 0;
+    int origin_y = 0;
+    int radius = -1;
+    int side = 0;
+    int words = 0;
+    std::vector<Uint64> bits;
+};
+
 // Enum to define the type of sound currently playing on the channel
 enum ChannelType
 {
@@ -47,18 +110,256 @@ class GravityEngine_Core
     // Gravity Engine public types
 public:
     // Enum to define which pixel-based graphical layer to work in
-    enum sprite_layer
+    // These are the default layers - more can be added to the layer stack with AddLayer
+    enum sprite_layer : int
     {
         ui, foreground, background, entity, debug
     };
+    // Enum to define where frames are presented
+    enum presentation_backend
+    {
+        sdl_window, ansi_terminal
+    };
+    // Enum to define the kind of a retained UI widget
+    enum ui_widget_type
+    {
+        ui_panel, ui_label, ui_bar, ui_button
+    };
     // Enum to define which collision layer to work in
     enum col_layer
     {
         stat, dyn
     };
+    // Enum to define which collision layers a query looks at (can be combined)
+    enum col_query
+    {
+        query_stat = 1, query_dyn = 2, query_both = 3
+    };
+    // Enum to define where a path request is
+    enum path_state
+    {
+        path_none, path_pending, path_found, path_blocked, path_invalid
+    };
 
     // Gravity Engine private types
 private:
+    // Sprite resource tracked by the texture manager
+    struct sprite_resource
+    {
+        SDL_Texture* texture = nullptr; // Loaded texture (nullptr if this slot is free)
+        std::string path; // File path the texture was loaded from (dedupe key)
+        int ref_count = 0; // Number of handles currently held by the game
+        size_t bytes = 0; // Texture memory used by this sprite
+        long last_used = 0; // Frame the sprite was last acquired or drawn (for LRU eviction)
+        int generation = 0; // Bumped every time the slot is freed, so handles to an earlier sprite in the slot stop working
+    };
+
+    // Light source on the collision grid
+    struct light_source
+    {
+        bool in_use = false; // Slot holds a light
+        double x = 0; // Horizontal position in collision cells
+        double y = 0; // Vertical position in collision cells
+        int radius = 0; // Reach in collision cells
+        SDL_Color color = { 255, 255, 255, 255 }; // Light color
+        float intensity = 1.f; // Brightness at the centre
+        bool dirty = true; // Contribution needs to be recomputed
+        int cx = 0; // Cell the contribution was computed from
+        int cy = 0; // Cell the contribution was computed from
+        int cr = -1; // Radius the contribution was computed with (-1 = never computed)
+        std::vector<float> contribution; // Brightness per cell of the (2 * cr + 1)^2 box around (cx, cy)
+    };
+
+    // Character cell of a layer's character grid
+    struct char_cell
+    {
+        char glyph = 0; // Character in the cell (0 = empty)
+        color c = { {255,255,255,255}, {0,0,0,255} }; // Letter and background color (alpha is ignored)
+        bool set = false; // Something was drawn in this cell
+        bool queued = false; // Glyph waiting in the layer's batch to be drawn
+    };
+
+    // Character waiting to be drawn over the geometry queued on a layer
+    struct queued_glyph
+    {
+        float x = 0; // Horizontal position
+        float y = 0; // Vertical position
+        char glyph = 0; // Character
+        SDL_Color c = { 255, 255, 255, 255 }; // Letter color
+        int cell = -1; // Index of the cell in the layer's character grid
+    };
+
+    // Axis-aligned box registered with the broadphase
+    struct broadphase_body
+    {
+        bool in_use = false; // Slot holds a body
+        double x = 0; // Horizontal position in collision cells (wrapped into the world)
+        double y = 0; // Vertical position in collision cells (wrapped into the world)
+        double w = 0; // Width in collision cells
+        double h = 0; // Height in collision cells
+        GravityEngine_Object* owner = nullptr; // Object the body belongs to
+        int bx0 = 0; // First bucket column the body is filed in
+        int by0 = 0; // First bucket row the body is filed in
+        int bx1 = -1; // Last bucket column the body is filed in (unwrapped, may pass the last column)
+        int by1 = -1; // Last bucket row the body is filed in (unwrapped, may pass the last row)
+        unsigned stamp = 0; // Query the body was last reported by (stops bodies in several buckets being reported twice)
+    };
+
+    // Path owned by an agent - Solved on the path workers and kept until a cell it crosses starts blocking it
+    struct path_entry
+    {
+        bool in_use = false; // Slot holds a path
+        path_state state = path_none; // Where the request is
+        bool queued = false; // Waiting for the next batch
+        unsigned serial = 0; // Bumped on every request so stale results from the workers are dropped
+        int requeues = 0; // Results of this request thrown away because the static layer changed under them
+        int sx = 0; // Horizontal cell coordinate of the start
+        int sy = 0; // Vertical cell coordinate of the start
+        int gx = 0; // Horizontal cell coordinate of the goal
+        int gy = 0; // Vertical cell coordinate of the goal
+        Uint8 mask = 0xFF; // Cell values that block the agent
+        std::vector<SDL_Point> points; // Jump points from the start to the goal
+        std::vector<int> cells; // Every cell the path crosses
+        void (*on_change)(int) = nullptr; // Called with the path id when it is solved, found blocked or invalidated
+    };
+
+    // Path request handed to the path workers
+    struct path_job
+    {
+        int id = 0; // Path index
+        unsigned serial = 0; // Request the job was made for
+        int sx = 0; // Horizontal cell coordinate of the start
+        int sy = 0; // Vertical cell coordinate of the start
+        int gx = 0; // Horizontal cell coordinate of the goal
+        int gy = 0; // Vertical cell coordinate of the goal
+        Uint8 mask = 0xFF; // Cell values that block the agent
+        unsigned revision = 0; // Static layer revision the grid was copied at
+        std::shared_ptr<const std::vector<char>> grid; // Copy of the static layer to search
+    };
+
+    // Path handed back by the path workers
+    struct path_result
+    {
+        int id = 0; // Path index
+        unsigned serial = 0; // Request the path was solved for
+        unsigned revision = 0; // Static layer revision the path was solved against
+        bool found = false; // A path exists
+        std::vector<SDL_Point> points; // Jump points from the start to the goal
+        std::vector<int> cells; // Every cell the path crosses
+    };
+
+    // Flow field built on a worker thread, handed back to the main thread when it is done
+    struct flow_build
+    {
+        int goal = -1; // Cell index of the goal the field was built for
+        std::vector<int> cost; // Integration field
+        std::vector<char> dir; // Direction field
+    };
+
+    // Flow field leading every cell to a shared goal - Integration field plus direction field over the static layer
+    struct flow_field
+    {
+        bool in_use = false; // Slot holds a field
+        Uint8 mask = 0xFF; // Cell values that block the agents
+        int goal = -1; // Cell index of the goal asked for (-1 = none yet)
+        bool rebuild = false; // The goal moved since the last build was started
+        int built_goal = -1; // Cell index of the goal cost and dir lead to
+        std::vector<int> cost; // Cost from each cell to the goal in tenths of a cell (10 straight, 14 diagonal, INT_MAX = unreachable)
+        std::vector<char> dir; // Direction from each cell to its next cell on the way to the goal ((dx + 1) * 3 + dy + 1, 4 = none)
+        std::vector<int> build_changes; // Static cells changed while a build was running, repaired once it is swapped in
+        std::future<flow_build> build; // Build running on a worker thread
+    };
+
+    // Search state owned by one path worker, sized to the grid and reused between searches
+    struct path_scratch
+    {
+        std::vector<float> g; // Cost from the start to each cell
+        std::vector<int> parent; // Jump point each cell was reached from
+        std::vector<char> dir; // Direction each cell was reached in ((dx + 1) * 3 + dy + 1)
+        std::vector<int> steps; // Cells between each cell and its parent
+        std::vector<unsigned> seen; // Search each cell was last reached in
+        std::vector<unsigned> closed; // Search each cell was last expanded in
+        unsigned search = 0; // Current search
+    };
+
+    // Retained UI widget - Owns a rectangle of the UI layer and is only redrawn when it changes
+    struct ui_widget
+    {
+        bool in_use = false; // Slot holds a widget
+        ui_widget_type type = ui_panel; // Kind of widget
+        int parent = -1; // Parent widget (-1 = root)
+        std::vector<int> children; // Child widgets, drawn after the parent in this order
+        SDL_FRect rect = { 0, 0, 0, 0 }; // Rectangle relative to the parent
+        SDL_FRect area = { 0, 0, 0, 0 }; // Rectangle on the screen (resolved from the parents)
+        bool visible = true; // Draw the widget and its children
+        color c = { {255,255,255,255}, {0,0,0,255} }; // Text, outline and bar color / background color
+        std::string text; // Label or button text
+        const std::string* bound_text = nullptr; // String the text follows (checked every frame)
+        TTF_Text* ttf_text = nullptr; // Laid out text (created the first time the widget is drawn)
+        double value = 0; // Bar value
+        double max_value = 1; // Bar value when full
+        const double* bound_value = nullptr; // Number the bar value follows (checked every frame)
+        void (*on_click)(int) = nullptr; // Called with the widget index when a button is clicked
+        bool hovered = false; // Mouse is over the button
+        bool pressed = false; // Button was pressed and the mouse has not been released yet
+    };
+
+    // Camera view into the world drawn on a rectangle of the screen
+    struct viewport
+    {
+        bool in_use = false; // Slot holds a viewport
+        float cam_x = 0; // Camera offset into the world (viewport 0 follows cam_offset_x instead)
+        float cam_y = 0; // Camera offset into the world (viewport 0 follows cam_offset_y instead)
+        SDL_FRect rect = { 0, 0, 0, 0 }; // Screen rectangle in drawing units
+    };
+
+    // Pixel-based graphical layer in the layer stack
+    struct graphic_layer
+    {
+        SDL_Texture* texture = nullptr; // Render target (created the first time the layer is drawn to)
+        bool in_use = false; // Slot holds a layer
+        bool world = true; // Scrolls with the camera and wraps around the world (false = fixed to the screen)
+        int z = 0; // Composite order (lower z is drawn first)
+        float parallax_x = 1.f; // Horizontal camera follow factor
+        float parallax_y = 1.f; // Vertical camera follow factor
+        float opacity = 1.f; // Alpha applied when compositing
+        SDL_BlendMode blend_mode = SDL_BLENDMODE_BLEND; // Blend mode applied when compositing
+        bool clear_each_frame = false; // Clear the layer at the end of every frame
+        bool visible = true; // Composite the layer
+        bool lit = false; // The light map is blended over the layer
+        bool indexed = false; // 8-bit palette layer - texture only holds the visible window, expanded at composite time
+        std::vector<Uint8> indices; // Palette index per pixel (indexed layers, allocated on first draw)
+        std::vector<SDL_Color> palette; // 256 palette entries (indexed layers)
+        bool indexed_dirty = true; // Indices or palette changed since the last expansion
+        float expanded_x = -1; // Main camera offset the visible window was last expanded at
+        float expanded_y = -1; // Main camera offset the visible window was last expanded at
+        int expanded_views = -1; // viewport_revision the visible window was last expanded at
+        std::vector<SDL_Vertex> batch_vertices; // Queued geometry waiting to be drawn on the layer
+        std::vector<int> batch_indices; // Triangle indices into batch_vertices
+        SDL_Texture* batch_texture = nullptr; // Texture the queued geometry samples (nullptr = solid color)
+        std::vector<queued_glyph> batch_glyphs; // Characters drawn over the queued geometry when the layer is flushed
+        std::vector<char_cell> cells; // Character grid (allocated on the first DrawChar)
+        bool empty = true; // Nothing has been drawn since the layer was last cleared
+        long last_drawn = 0; // Frame the layer was last drawn on
+        bool ring = false; // Screen-sized ring buffer scrolled by the main camera, filled in by on_exposed
+        void (*on_exposed)(sprite_layer, int, int, int, int, int, int) = nullptr; // Draws a newly exposed strip of a ring layer
+        double ring_cam_x = 0; // Unwrapped main camera position (ring layers)
+        double ring_cam_y = 0; // Unwrapped main camera position (ring layers)
+        int ring_x = 0; // World position of the top left of the screen (ring layers)
+        int ring_y = 0; // World position of the top left of the screen (ring layers)
+        int ring_last_x = 0; // cam_offset_x when the ring layer was last scrolled
+        int ring_last_y = 0; // cam_offset_y when the ring layer was last scrolled
+        bool ring_valid = false; // The ring buffer holds the window at ring_x, ring_y
+    };
+
+    // Group of draw calls recorded once into a texture and replayed as a single quad
+    struct draw_group
+    {
+        bool in_use = false; // Slot holds a group
+        std::string key; // Name the group is looked up by
+        graphic_layer target; // Texture and batch the draws are recorded into
+        bool valid = false; // The texture holds an up to date recording
+    };
 
     // Gravity Engine private classes
 private:
@@ -288,8 +589,41 @@ private:
     bool game_running = false; // Is the game running or no?
     int canvas_w; // Game canvas width
     int canvas_h; // Game canvas height
-    char** collision_static; // Game static collision layer
-    char** collision_dynamic; // Game dynamic collision layer
+    char* collision_static = nullptr; // Game static collision layer (col_stride bytes per row, cache aligned)
+    char* collision_dynamic = nullptr; // Game dynamic collision layer (col_stride bytes per row, cache aligned)
+    int col_stride = 0; // Bytes per collision row, padded to a cache line
+    bool collision_bits_enabled = false; // Keep the bit-packed solidity layers in sync
+    std::vector<Uint64> solid_bits_static; // One bit per static cell that is not 0 (col_words words per row)
+    std::vector<Uint64> solid_bits_dynamic; // One bit per dynamic cell that is not 0 (col_words words per row)
+    int col_words = 0; // 64-bit words per row of the solidity bits
+    std::vector<std::vector<int>> occupancy; // Occupancy pyramid - Level k counts the solid static cells in each 2^k square
+    std::vector<int> occupancy_w; // Width of each pyramid level
+    std::atomic<bool> distance_enabled = false; // Keep the distance field in sync with the static layer (set once the field is built)
+    std::vector<int> distance_sq; // Squared distance from each cell to the nearest solid static cell (INT_MAX = none)
+    std::vector<int> distance_obst; // Nearest solid static cell of each cell (-1 = none)
+    std::vector<char> distance_raise; // Cell is queued to have its distance raised because its nearest solid cell went away
+    std::vector<int> distance_changed; // Static cells whose solidity changed since the field was last updated
+    std::shared_mutex distance_mutex; // Lets worker threads read the field while the main thread updates it
+    std::thread::id main_thread = std::this_thread::get_id(); // Thread the engine was created on
+    unsigned static_revision = 0; // Bumped on every change to the static layer
+    unsigned static_opened_revision = 0; // static_revision of the last change that cleared bits from a static cell
+    int path_max_requeues = 3; // Times a path is solved again because the static layer changed under it before the result is kept anyway
+    std::vector<path_entry> paths; // Path requests (removed paths leave their slot free for reuse)
+    std::vector<int> paths_queued; // Paths waiting to be handed to the workers
+    std::unordered_map<int, std::vector<int>> path_watch; // Static cell -> Solved paths that cross it
+    std::shared_ptr<const std::vector<char>> static_copy; // Copy of the static layer for worker threads
+    unsigned static_copy_revision = UINT_MAX; // Static layer revision static_copy was taken at
+    std::vector<std::thread> path_workers; // Threads solving path requests
+    std::mutex path_mutex; // Guards the job and result queues
+    std::condition_variable path_wake; // Wakes the workers when jobs arrive
+    std::deque<path_job> path_jobs; // Requests waiting for a worker
+    std::vector<path_result> path_results; // Solved requests waiting for the main thread
+    bool path_workers_stop = false; // Tells the workers to exit
+    std::vector<flow_field> flow_fields; // Flow fields (removed fields leave their slot free for reuse)
+    std::vector<int> flow_changed; // Static cells changed since the flow fields were last repaired
+    std::vector<int> dyn_span_min; // First cell written on each dynamic row this frame (INT_MAX = row is clean)
+    std::vector<int> dyn_span_max; // Last cell written on each dynamic row this frame
+    std::vector<int> dyn_dirty_rows; // Dynamic rows written this frame
     int elapsed_frames = 0; // Frames since game was started
     color def_color = { {255,255,255}, {0,0,0} }; // Default color to clean the color arrays
     int def_col = 0; // Default collision value to clean the collision arrays with
@@ -306,27 +640,88 @@ private:
     const char* game_version; // The version of the game
     int scr_w; // W of screen
     int scr_h; // H of screen
+    int render_w; // W of the internal render resolution (the screen width unless SetInternalResolution is used)
+    int render_h; // H of the internal render resolution (the screen height unless SetInternalResolution is used)
+    bool low_res = false; // Render at the internal resolution and integer upscale to the window when presenting
+    bool font_w_auto = false; // Font width was auto-detected from the resolution
+    bool font_h_auto = false; // Font height was auto-detected from the resolution
+    SDL_FRect present_rect = { 0, 0, 0, 0 }; // Where the internal resolution lands in the window when low_res is on (refreshed by GetPresentRect)
+    float render_scale = 1.f; // Dynamic scale of the world layers (logical coordinates are unaffected)
+    bool dynamic_resolution = false; // Adjust render_scale to keep compositing inside the budget
+    int64_t drs_budget = 0; // Compositing time budget in nanoseconds
+    float drs_min_scale = 0.5f; // Lowest render scale the controller may pick
+    float drs_max_scale = 1.f; // Highest render scale the controller may pick
+    float drs_step = 0.125f; // How much the render scale changes per adjustment
+    int drs_cooldown = 0; // Frames to wait before the next adjustment
+    int64_t composite_time = 0; // Time spent compositing and presenting the last frame in nanoseconds
+    double composite_time_avg = 0; // Smoothed compositing time in nanoseconds
     int SDL_window_props = SDL_WINDOW_FULLSCREEN; //0;
     bool screen_updated = false; // The flag that tells the game if it should update the screen or not
     std::string font_path; // Location of the font to use for the text on screen
     SDL_Window* window = NULL; // Pointer to the SDL window object
     SDL_Renderer* renderer = NULL; // Pointer to the SDL renderer object
-    SDL_Texture* render_texture = NULL; // The texture for the entire screen
-    SDL_Texture* render_texture_ui = NULL; // The texture for the entire screen
+    SDL_Texture* present_texture = NULL; // Internal resolution frame that is upscaled to the window when low_res is on
     TTF_TextEngine* engine = NULL; // Point to the SDL_ttf text engine
     TTF_Font* sans = NULL; // SDL_ttf font to use
-    SDL_Texture* p_background_texture = NULL; // Background sprite layer
-    SDL_Texture* p_entity_texture = NULL; // Enttiy sprite layer
-    SDL_Texture* p_foreground_texture = NULL; // Foreground sprite layer
-    SDL_Texture* p_ui_texture = NULL; // Ui sprite layer
-    SDL_Texture* p_debug_texture = NULL; // Debug sprite layer
+    TTF_Text* glyph_texts[256] = {}; // One laid out text per character drawn on the character grid (created on first use)
+    std::vector<graphic_layer> layers; // Layer stack, indexed by sprite_layer
+    std::vector<int> layer_order; // Layer indices sorted by z for compositing
+    int layer_release_frames = 120; // Frames a cleared layer can go undrawn before its texture is freed (0 = never free)
+    bool minimap_enabled = false; // Keep the minimap texture in sync with the collision layers
+    SDL_Texture* minimap_texture = nullptr; // Minimap, one texel per collision cell
+    Uint32 minimap_colors[256]; // ARGB color per collision value
+    std::vector<Uint32> minimap_pixels; // ARGB minimap pixels waiting to be uploaded
+    std::vector<char> minimap_cell_dirty; // Cells whose minimap pixel needs to be recomputed
+    std::vector<int> minimap_dirty_cells; // List of the cells flagged in minimap_cell_dirty
+    std::vector<SDL_Rect> minimap_tile_rects; // Bounds of the changed pixels in each 32x32 tile of the minimap (w = 0 when none)
+    std::vector<int> minimap_dirty_tiles; // List of the tiles with changed pixels
+    presentation_backend backend = sdl_window; // Where frames are presented
+    std::vector<char_cell> terminal_cells; // Character grid as the terminal currently shows it
+    bool terminal_started = false; // The terminal has been cleared and the cursor hidden
+    SDL_Texture* upload_texture = nullptr; // Streaming texture bulk layer uploads are written into
+    int upload_layer = -1; // Layer with a region locked for a bulk upload (-1 = none)
+    SDL_FRect upload_src = { 0, 0, 0, 0 }; // Part of upload_texture that is locked
+    SDL_FRect upload_dst = { 0, 0, 0, 0 }; // Where the locked region goes on the layer
+    std::vector<draw_group> draw_groups; // Recorded draw groups
+    std::unordered_map<std::string, int> draw_group_keys; // Lookup from key to draw group index
+    int recording_group = -1; // Draw group the draw calls are being recorded into (-1 = none)
+    std::vector<ui_widget> ui_widgets; // Retained UI widget tree
+    sprite_layer ui_layer = ui; // Layer the widgets own regions of
+    std::vector<int> ui_draw_order; // Visible widgets, parents before children
+    std::vector<std::vector<int>> ui_buckets; // Visible widgets touching each ui_bucket_size square of the screen, in draw order
+    int ui_bucket_size = 64; // Size of a hit-test bucket in drawing units
+    bool ui_layout_dirty = false; // Widget tree or rectangles changed since ui_draw_order was built
+    std::vector<SDL_FRect> ui_damage; // Rectangles of the UI layer that need to be redrawn
+    bool ui_mouse_down = false; // Left button state last frame
+    std::vector<viewport> viewports; // Views of the world composited onto the screen (0 is the main camera)
+    int viewport_revision = 0; // Bumped whenever a viewport changes
+    std::vector<broadphase_body> bodies; // Broadphase bodies
+    std::vector<std::vector<int>> body_buckets; // Bodies touching each body_bucket_size square of the world
+    int body_bucket_size = 4; // Size of a broadphase bucket in collision cells
+    int body_bucket_cols = 0; // Broadphase buckets across the world
+    int body_bucket_rows = 0; // Broadphase buckets down the world
+    unsigned body_stamp = 0; // Current broadphase query
+    std::vector<light_source> lights; // Light sources for the grid lighting
+    bool lighting_enabled = false; // Composite the light map
+    SDL_Color ambient_light = { 0, 0, 0, 255 }; // Light level of cells no light reaches
+    SDL_Texture* light_texture = nullptr; // Light map, one texel per collision cell
+    SDL_Texture* lit_texture = nullptr; // Output-sized target the lit layers are composited into before the light map is applied
+    SDL_Texture* lit_output = nullptr; // Target the lit layers go back into (nullptr = the window)
+    std::vector<float> light_accum; // RGB light per collision cell
+    std::vector<Uint32> light_pixels; // ARGB light map pixels waiting to be uploaded
+    std::vector<char> light_cell_dirty; // Cells whose light needs to be recomputed
+    std::vector<int> light_dirty_cells; // List of the cells flagged in light_cell_dirty
     const bool* keyboard_keys = SDL_GetKeyboardState(NULL); // Initialize keystate list
     std::vector<GravityEngine_AudioChannel*> audio_channels; // List of all audio channels
     std::vector<GravityEngine_Sound*> sounds; // List of all saved sounds
     int channels; // Channel count
     int mouse_wheel_state; // Store the current 
     std::ofstream file_out = std::ofstream("output.txt");
-    std::vector<SDL_Texture*> sprite_list; // List of sprite resources loaded into the game
+    std::vector<sprite_resource> sprite_list; // List of sprite resources loaded into the game
+    std::unordered_map<std::string, int> sprite_paths; // Lookup from file path to sprite index
+    std::vector<int> sprite_free_slots; // Sprite indices that can be reused by the next load
+    size_t sprite_memory_used = 0; // Texture memory used by all resident sprites
+    size_t sprite_memory_budget = 0; // Memory allowed before unreferenced sprites are evicted (0 = evict as soon as unreferenced)
 
     // Gravity Engine Public Attributes
 public:
@@ -359,6 +754,8 @@ public:
         // Set screen resolution
         scr_w = sw;
         scr_h = sh;
+        render_w = sw;
+        render_h = sh;
 
         // Set the dims of the game canvas
         canvas_w = cw;
@@ -368,6 +765,8 @@ public:
         game_version = gv;
 
         // Set the dims of the font
+        font_w_auto = fw == -1;
+        font_h_auto = fh == -1;
         if (fw == -1)
             fw = (int)(floor(scr_w / cw));
         if (fh == -1)
@@ -375,21 +774,30 @@ public:
         font_w = fw;
         font_h = fh;
 
-        // Instantiate collision static
-        collision_static = new char* [canvas_h * 2];
-        for (int i = 0; i < canvas_h * 2; i++)
-            collision_static[i] = new char[canvas_w * 2];
-        for (int i = 0; i < canvas_h * 2; i++)
-            for (int q = 0; q < canvas_w * 2; q++)
-                collision_static[i][q] = def_col;
-
-        // Instantiate collision dynamic
-        collision_dynamic = new char* [canvas_h * 2];
-        for (int i = 0; i < canvas_h * 2; i++)
-            collision_dynamic[i] = new char[canvas_w * 2];
-        for (int i = 0; i < canvas_h * 2; i++)
-            for (int q = 0; q < canvas_w * 2; q++)
-                collision_dynamic[i][q] = def_col;
+        // Instantiate the collision layers - One block each, rows padded to a cache line
+        col_stride = (canvas_w * 2 + 63) & ~63;
+        col_words = (canvas_w * 2 + 63) / 64;
+        collision_static = (char*)SDL_aligned_alloc(64, col_stride * canvas_h * 2);
+        collision_dynamic = (char*)SDL_aligned_alloc(64, col_stride * canvas_h * 2);
+        memset(collision_static, def_col, col_stride * canvas_h * 2);
+        memset(collision_dynamic, def_col, col_stride * canvas_h * 2);
+        dyn_span_min.assign(canvas_h * 2, INT_MAX);
+        dyn_span_max.assign(canvas_h * 2, -1);
+
+        // The main viewport covers the screen and follows cam_offset_x/y
+        viewports.resize(1);
+        viewports[0].in_use = true;
+        viewports[0].rect = { 0, 0, (float)render_w, (float)render_h };
+
+        // Create the default layer stack - Textures are only allocated once a layer is drawn to
+        layers.resize(debug + 1);
+        SetupLayer(background, 0, true, false);
+        SetupLayer(entity, 100, true, true);
+        SetupLayer(foreground, 200, true, false);
+        SetupLayer(ui, 300, false, false);
+        SetupLayer(debug, 400, false, true);
+        layers[entity].lit = true;
+        layers[foreground].lit = true;
 
         // Set the desired frame length to 1 second divided be the desired frame rate
         frame_length = 1000000000 / f;
@@ -429,9 +837,9 @@ public:
         if (x >= 0 && x < canvas_w * 2 && y >= 0 && y < canvas_h * 2)
         {
             if (cl == stat)
-                return collision_static[y][x];
+                return collision_static[y * col_stride + x];
             else
-                return collision_dynamic[y][x];
+                return collision_dynamic[y * col_stride + x];
         }
         else
         {
@@ -448,499 +856,5301 @@ public:
     {
         if (x >= 0 && x < canvas_w * 2 && y >= 0 && y < canvas_h * 2)
         {
+            char* cell = (cl == stat ? collision_static : collision_dynamic) + y * col_stride + x;
+            if (*cell == (char)v)
+                return;
+            if (cl == dyn)
+                MarkDynamicSpan(y, x, x + 1);
+            // The minimap only needs the cells that actually change
+            if (minimap_enabled)
+                MarkMinimapCellDirty(y * canvas_w * 2 + x);
+            // Lights that can see this cell need a new shadowcast when it turns solid or clear
+            if (cl == stat && !lights.empty() && (*cell != 0) != (v != 0))
+                InvalidateLightsAt(x, y);
+            // Paths crossing the cell are dropped when it starts blocking them
+            if (cl == stat)
+            {
+                static_revision++;
+                if ((*cell & ~v) != 0)
+                    static_opened_revision = static_revision;
+                if (v != 0 && !path_watch.empty())
+                    InvalidatePathsAt(y * canvas_w * 2 + x, v);
+                if (!flow_fields.empty())
+                    flow_changed.insert(flow_changed.end(), y * canvas_w * 2 + x);
+            }
+            // The distance field is repaired around the cell once per frame
+            if (cl == stat && distance_enabled && (*cell != 0) != (v != 0))
+                distance_changed.insert(distance_changed.end(), y * canvas_w * 2 + x);
+            // Every pyramid level above the cell gains or loses one solid cell
+            if (cl == stat && !occupancy.empty() && (*cell != 0) != (v != 0))
+                for (int k = 0; k < (int)occupancy.size(); k++)
+                    occupancy[k][(y >> k) * occupancy_w[k] + (x >> k)] += v != 0 ? 1 : -1;
+            if (collision_bits_enabled)
+            {
+                Uint64& word = (cl == stat ? solid_bits_static : solid_bits_dynamic)[y * col_words + x / 64];
+                if (v != 0)
+                    word |= (Uint64)1 << (x % 64);
+                else
+                    word &= ~((Uint64)1 << (x % 64));
+            }
+            *cell = v;
+        }
+    }
+
+    // Set a run of cells on one row to the same collision type
+    // int x : Horizontal coordinate of the first cell
+    // int y : Vertical coordinate
+    // int w : Number of cells
+    // col_layer cl : Layer to set collision on
+    // int v : Collision type value
+    void SetCollisionSpan(int x, int y, int w, col_layer cl, int v)
+    {
+        if (y < 0 || y >= canvas_h * 2)
+            return;
+        int x0 = std::max(x, 0);
+        int x1 = std::min(x + w, canvas_w * 2);
+        // Without anything watching the cells the row can be filled directly
+        if (!minimap_enabled && lights.empty() && !collision_bits_enabled && (cl == dyn || (occupancy.empty() && !distance_enabled && path_watch.empty() && flow_fields.empty())))
+        {
+            if (x1 <= x0)
+                return;
+            // The old values are not looked at, so treat the run as opened cells
             if (cl == stat)
-                collision_static[y][x] = v;
-            else if (cl == dyn)
-                collision_dynamic[y][x] = v;
+                static_opened_revision = ++static_revision;
+            memset((cl == stat ? collision_static : collision_dynamic) + y * col_stride + x0, v, x1 - x0);
+            if (cl == dyn)
+                MarkDynamicSpan(y, x0, x1);
+            return;
         }
+        for (int i = x0; i < x1; i++)
+            SetCollisionValue(i, y, cl, v);
     }
 
-    // Gravity Engine Destructor
-    ~GravityEngine_Core()
+    // Get a row of a collision layer for tight loops
+    // The row holds GetCanvasW() * 2 values and rows are GetCollisionStride() bytes apart. Returns nullptr if y is off the grid
+    // int y : Vertical coordinate
+    // col_layer cl : Layer to read
+    const char* GetCollisionRow(int y, col_layer cl)
     {
-        // Delete all of the layers
-        delete[] collision_static;
-        delete[] collision_dynamic;
+        if (y < 0 || y >= canvas_h * 2)
+            return nullptr;
+        return (cl == stat ? collision_static : collision_dynamic) + y * col_stride;
     }
 
-    // Start the video game
-    // void (*init_game)() : Custom game initialization function
-    // void (*pre_loop_code)() : Custom global begin-step function
-    // void (*post_loop_code)() : Custom global end-step function
-    SDL_AppResult Start(void (*init_game)() = nullptr, void (*pre_loop_code)() = nullptr, void (*post_loop_code)() = nullptr)
+    // Get the distance in bytes between rows of a collision layer
+    int GetCollisionStride()
     {
-        // Game is running now
-        game_running = true;
+        return col_stride;
+    }
 
-        // Initialize SDL app meta data
-        SDL_SetAppMetadata(game_title, game_version, game_id);
-        // Initialize SDL library
-        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) == false)
+    // Keep a bit-packed copy of the collision layers with one bit per cell that is not 0
+    // Bit x % 64 of word x / 64 of a row is set when the cell is solid
+    void EnableCollisionBits()
+    {
+        if (collision_bits_enabled)
+            return;
+        collision_bits_enabled = true;
+        solid_bits_static.assign(col_words * canvas_h * 2, 0);
+        solid_bits_dynamic.assign(col_words * canvas_h * 2, 0);
+        for (int y = 0; y < canvas_h * 2; y++)
         {
-            std::cout << SDL_GetError() << std::endl;
-            std::system("pause");
+            for (int x = 0; x < canvas_w * 2; x++)
+            {
+                if (collision_static[y * col_stride + x] != 0)
+                    solid_bits_static[y * col_words + x / 64] |= (Uint64)1 << (x % 64);
+                if (collision_dynamic[y * col_stride + x] != 0)
+                    solid_bits_dynamic[y * col_words + x / 64] |= (Uint64)1 << (x % 64);
+            }
         }
-        // Create the SDL window
-        SDL_CreateWindowAndRenderer(game_title, canvas_w * font_w, canvas_h * font_h, SDL_window_props, &window, &renderer);
-
-        // Load the audio spec
-        auto dev = SDL_OpenAudioDevice(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, NULL);
-        SDL_GetAudioDeviceFormat(dev, &global_audio_spec, nullptr);
-        SDL_CloseAudioDevice(dev);
+    }
 
-        // Initialize all audio channels
-        for (int i = 0; i < channels; i++)
-            audio_channels.insert(audio_channels.end(), new GravityEngine_AudioChannel(global_audio_spec));
+    // Get a row of the bit-packed solidity of a collision layer (EnableCollisionBits is called if needed)
+    // The row holds GetCollisionBitsWords() words. Returns nullptr if y is off the grid
+    // int y : Vertical coordinate
+    // col_layer cl : Layer to read
+    const Uint64* GetSolidBitsRow(int y, col_layer cl)
+    {
+        if (y < 0 || y >= canvas_h * 2)
+            return nullptr;
+        EnableCollisionBits();
+        return (cl == stat ? solid_bits_static : solid_bits_dynamic).data() + y * col_words;
+    }
 
-        // Create the render texture
-        render_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scr_w * 4, scr_h * 4);
-        render_texture_ui = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scr_w, scr_h);
-        p_background_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scr_w * 2, scr_h * 2);
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_SetRenderTarget(renderer, p_background_texture);
-        SDL_RenderClear(renderer);
-        p_foreground_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scr_w * 2, scr_h * 2);
-        p_entity_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scr_w * 2, scr_h * 2);
-        p_ui_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scr_w, scr_h);
-        p_debug_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scr_w, scr_h);
+    // Get the number of 64-bit words in a row of the bit-packed solidity
+    int GetCollisionBitsWords()
+    {
+        return col_words;
+    }
 
-        // Create the engine used to write text
-        engine = TTF_CreateRendererTextEngine(renderer);
+    // Look for cells in a rectangle of the collision grid whose value shares a bit with a mask
+    // Collision values are treated as bit sets, so a cell matches when (value & mask) != 0. The rect wraps around the world
+    // int x : Horizontal coordinate of the rect
+    // int y : Vertical coordinate of the rect
+    // int w : Width of the rect in cells
+    // int h : Height of the rect in cells
+    // Uint8 mask : Collision bits to look for
+    // int layers : Layers to look in (query_stat, query_dyn or query_both)
+    // bool count_all : Count every matching cell instead of stopping at the first
+    collision_hit QueryRect(int x, int y, int w, int h, Uint8 mask, int layers = query_both, bool count_all = false)
+    {
+        collision_hit hit;
+        int gw = canvas_w * 2;
+        int gh = canvas_h * 2;
+        if (w <= 0 || h <= 0 || mask == 0 || (layers & query_both) == 0)
+            return hit;
+        w = std::min(w, gw);
+        h = std::min(h, gh);
+        x = WrapCellX(x);
+        y = WrapCellY(y);
+        for (int r = 0; r < h; r++)
+        {
+            int yy = y + r < gh ? y + r : y + r - gh;
+            const char* a = (layers & query_stat) ? collision_static + yy * col_stride : nullptr;
+            const char* b = (layers & query_dyn) ? collision_dynamic + yy * col_stride : nullptr;
+            // A row of the rect is at most two spans: up to the edge of the world, then from the other side
+            int first = -1;
+            int x1 = std::min(x + w, gw);
+            hit.count += ScanCollisionSpan(a, b, x, x1, mask, !count_all, &first);
+            if (x + w > gw && (count_all || first < 0))
+                hit.count += ScanCollisionSpan(a, b, 0, x + w - gw, mask, !count_all, &first);
+            if (first >= 0 && !hit.any)
+            {
+                hit.any = true;
+                hit.first_x = first;
+                hit.first_y = yy;
+            }
+            if (hit.any && !count_all)
+                return hit;
+        }
+        return hit;
+    }
 
-        // Init SDL ttf
-        TTF_Init();
+    // Look for matching cells under a box given in fractional cells
+    // A box edge that lies on a cell boundary (within rounding) does not reach into the next cell
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // double w : Width in collision cells
+    // double h : Height in collision cells
+    // Uint8 mask : Collision bits to look for
+    // int layers : Layers to look in (query_stat, query_dyn or query_both)
+    collision_hit QueryBox(double x, double y, double w, double h, Uint8 mask, int layers = query_both)
+    {
+        int x0 = SpanLow(x, 0);
+        int x1 = SpanHigh(x + w, 0);
+        int y0 = SpanLow(y, 0);
+        int y1 = SpanHigh(y + h, 0);
+        return QueryRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1, mask, layers);
+    }
 
-        // Create font
-        const char* fp = font_path.c_str();
-        sans = TTF_OpenFont(fp, font_h);
+    // Cast a ray through the collision grid, visiting only the cells it passes through (Amanatides-Woo DDA)
+    // The ray wraps around the world. A ray that starts in a matching cell hits at toi 0 with no normal.
+    // Rays against the static layer alone jump over empty squares of the occupancy pyramid once it is enabled
+    // double x : Horizontal start in collision cells
+    // double y : Vertical start in collision cells
+    // double dx : Horizontal length of the ray in collision cells
+    // double dy : Vertical length of the ray in collision cells
+    // Uint8 mask : Collision bits that stop the ray
+    // int layers : Layers to look in (query_stat, query_dyn or query_both)
+    collision_sweep Raycast(double x, double y, double dx, double dy, Uint8 mask, int layers = query_both)
+    {
+        collision_sweep result;
+        int cx = (int)floor(x);
+        int cy = (int)floor(y);
+        int step_x = dx > 0 ? 1 : dx < 0 ? -1 : 0;
+        int step_y = dy > 0 ? 1 : dy < 0 ? -1 : 0;
+        // Time to the first boundary on each axis and between boundaries after that
+        double t_max_x = step_x > 0 ? (cx + 1 - x) / dx : step_x < 0 ? (cx - x) / dx : INFINITY;
+        double t_max_y = step_y > 0 ? (cy + 1 - y) / dy : step_y < 0 ? (cy - y) / dy : INFINITY;
+        double t_delta_x = step_x != 0 ? 1 / fabs(dx) : INFINITY;
+        double t_delta_y = step_y != 0 ? 1 / fabs(dy) : INFINITY;
+        bool skip = (layers & query_both) == query_stat && !occupancy.empty();
+        double t = 0;
+        int nx = 0;
+        int ny = 0;
+        while (true)
+        {
+            if (CellMatches(cx, cy, mask, layers))
+            {
+                result.hit = true;
+                result.toi = t;
+                result.cell_x = WrapCellX(cx);
+                result.cell_y = WrapCellY(cy);
+                result.normal_x = nx;
+                result.normal_y = ny;
+                return result;
+            }
+            // Jump to where the ray leaves the largest empty pyramid square around this cell
+            int k = skip ? EmptyOccupancyLevel(cx, cy) : 0;
+            if (k > 0)
+            {
+                int wx = WrapCellX(cx);
+                int wy = WrapCellY(cy);
+                int x0 = cx - (wx & ((1 << k) - 1));
+                int y0 = cy - (wy & ((1 << k) - 1));
+                int x1 = x0 + std::min(1 << k, canvas_w * 2 - (wx >> k << k));
+                int y1 = y0 + std::min(1 << k, canvas_h * 2 - (wy >> k << k));
+                double exit_x = step_x > 0 ? (x1 - x) / dx : step_x < 0 ? (x0 - x) / dx : INFINITY;
+                double exit_y = step_y > 0 ? (y1 - y) / dy : step_y < 0 ? (y0 - y) / dy : INFINITY;
+                t = std::min(exit_x, exit_y);
+                if (t > 1)
+                    return result;
+                nx = 0;
+                ny = 0;
+                if (exit_x < exit_y)
+                {
+                    cx = step_x > 0 ? x1 : x0 - 1;
+                    cy = std::clamp((int)floor(y + dy * t), y0, y1 - 1);
+                    nx = -step_x;
+                }
+                else
+                {
+                    cy = step_y > 0 ? y1 : y0 - 1;
+                    cx = std::clamp((int)floor(x + dx * t), x0, x1 - 1);
+                    ny = -step_y;
+                }
+                t_max_x = step_x > 0 ? (cx + 1 - x) / dx : step_x < 0 ? (cx - x) / dx : INFINITY;
+                t_max_y = step_y > 0 ? (cy + 1 - y) / dy : step_y < 0 ? (cy - y) / dy : INFINITY;
+                continue;
+            }
+            nx = 0;
+            ny = 0;
+            if (t_max_x < t_max_y)
+            {
+                t = t_max_x;
+                cx += step_x;
+                t_max_x += t_delta_x;
+                nx = -step_x;
+            }
+            else
+            {
+                t = t_max_y;
+                cy += step_y;
+                t_max_y += t_delta_y;
+                ny = -step_y;
+            }
+            if (t > 1)
+                return result;
+        }
+    }
 
-        // Call init custom user code
-        if (init_game != nullptr)
-            init_game();
+    // Build the occupancy pyramid over the static collision layer
+    // Level 0 holds 1 for every cell that is not 0, and each level above counts the solid cells in squares twice the size.
+    // SetCollisionValue keeps it up to date in one step per level. The pyramid queries call this on first use
+    void EnableOccupancyPyramid()
+    {
+        if (!occupancy.empty())
+            return;
+        int w = canvas_w * 2;
+        int h = canvas_h * 2;
+        occupancy.insert(occupancy.end(), std::vector<int>(w * h));
+        occupancy_w.insert(occupancy_w.end(), w);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                occupancy[0][y * w + x] = collision_static[y * col_stride + x] != 0;
+        // Halve until one square covers the whole grid
+        while (w > 1 || h > 1)
+        {
+            int pw = w;
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+            std::vector<int> level(w * h, 0);
+            std::vector<int>& below = occupancy.back();
+            for (int i = 0; i < (int)below.size(); i++)
+                level[(i / pw / 2) * w + (i % pw) / 2] += below[i];
+            occupancy.insert(occupancy.end(), level);
+            occupancy_w.insert(occupancy_w.end(), w);
+        }
+    }
 
-        // Call game loop
-        GameLoop(pre_loop_code, post_loop_code);
+    // Start keeping a distance field over the static collision layer
+    // Every cell knows how far it is from the nearest solid static cell (wrapping around the world). Changes to the static layer
+    // are repaired once per frame, only around the cells that changed. Reads are safe from worker threads. Main thread only
+    void EnableDistanceField()
+    {
+        if (distance_enabled || std::this_thread::get_id() != main_thread)
+            return;
+        std::unique_lock<std::shared_mutex> lock(distance_mutex);
+        int cells = canvas_w * 2 * canvas_h * 2;
+        distance_sq.assign(cells, INT_MAX);
+        distance_obst.assign(cells, -1);
+        distance_raise.assign(cells, 0);
+        // Every solid cell starts a wave
+        for (int i = 0; i < cells; i++)
+            if (collision_static[i / (canvas_w * 2) * col_stride + i % (canvas_w * 2)] != 0)
+                distance_changed.insert(distance_changed.end(), i);
+        lock.unlock();
+        UpdateDistanceField();
+        // Worker threads only read the field once it is whole
+        distance_enabled = true;
+    }
 
-        // -= GAME END =-
-        // Clenup goes here
+    // Get the distance from a cell to the nearest solid static cell in cells (0 on a solid cell, INFINITY if there are none)
+    // Enables the distance field on first use from the main thread. Worker threads get -1 until it has been enabled
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    float GetDistanceToSolid(int x, int y)
+    {
+        if (!distance_enabled)
+        {
+            if (std::this_thread::get_id() != main_thread)
+                return -1;
+            EnableDistanceField();
+        }
+        std::shared_lock<std::shared_mutex> lock(distance_mutex);
+        int d = distance_sq[WrapCellY(y) * canvas_w * 2 + WrapCellX(x)];
+        return d == INT_MAX ? INFINITY : sqrt((float)d);
+    }
 
-        // TTF Quit
-        TTF_DestroyRendererTextEngine(engine);
-        TTF_Quit();
+    // Get the solid static cell nearest to a cell from the distance field. Returns false if there are none
+    // Enables the distance field on first use from the main thread. Worker threads get false until it has been enabled
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    // int* ret_x : Pointer to store the horizontal coordinate of the solid cell
+    // int* ret_y : Pointer to store the vertical coordinate of the solid cell
+    bool GetNearestSolidCell(int x, int y, int* ret_x, int* ret_y)
+    {
+        if (!distance_enabled)
+        {
+            if (std::this_thread::get_id() != main_thread)
+                return false;
+            EnableDistanceField();
+        }
+        std::shared_lock<std::shared_mutex> lock(distance_mutex);
+        int o = distance_obst[WrapCellY(y) * canvas_w * 2 + WrapCellX(x)];
+        if (o < 0)
+            return false;
+        *ret_x = o % (canvas_w * 2);
+        *ret_y = o / (canvas_w * 2);
+        return true;
+    }
 
-        // Free audio channels
-        for (auto ac : audio_channels)
-            delete ac;
-        for (auto s : sounds)
-            delete s;
+    // Check if there is at least a given clearance around a cell (false on worker threads until the distance field is enabled)
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    // float radius : Clearance needed in cells
+    bool HasRoom(int x, int y, float radius)
+    {
+        return GetDistanceToSolid(x, y) >= radius;
+    }
 
-        // Kill SDL
-        SDL_Quit();
+    // Count the solid static cells in a rectangle, wrapping around the world
+    // Whole pyramid squares inside the rectangle are counted in one step, so the cost follows the rectangle's edge, not its area
+    // int x : Horizontal coordinate of the rect
+    // int y : Vertical coordinate of the rect
+    // int w : Width of the rect in cells
+    // int h : Height of the rect in cells
+    int CountSolid(int x, int y, int w, int h)
+    {
+        return CountOccupancy(x, y, w, h, INT_MAX);
+    }
 
-        // Free all objects
-        for (auto o : entity_list)
-            delete o;
-        for (auto s : sprite_list)
-            SDL_DestroyTexture(s);
+    // Check if a rectangle of the static collision layer has no solid cells, wrapping around the world
+    // int x : Horizontal coordinate of the rect
+    // int y : Vertical coordinate of the rect
+    // int w : Width of the rect in cells
+    // int h : Height of the rect in cells
+    bool IsRegionEmpty(int x, int y, int w, int h)
+    {
+        return CountOccupancy(x, y, w, h, 1) == 0;
+    }
 
-        // Success!
-        return SDL_APP_SUCCESS;
+    // Find the solid static cell nearest to a point, wrapping around the world
+    // Searches the pyramid best-first, so empty areas are passed over a whole square at a time. Returns false if there is none in range
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // double max_distance : Furthest distance to look (0 = anywhere)
+    // int* ret_x : Pointer to store the horizontal coordinate of the cell
+    // int* ret_y : Pointer to store the vertical coordinate of the cell
+    bool FindNearestSolid(double x, double y, double max_distance, int* ret_x, int* ret_y)
+    {
+        EnableOccupancyPyramid();
+        double gw = canvas_w * 2;
+        double gh = canvas_h * 2;
+        double limit = max_distance > 0 ? max_distance * max_distance : INFINITY;
+        // Squares are visited closest first - Entries are (squared distance, level, square index)
+        std::priority_queue<std::tuple<double, int, int>, std::vector<std::tuple<double, int, int>>, std::greater<std::tuple<double, int, int>>> open;
+        open.push({ 0.0, (int)occupancy.size() - 1, 0 });
+        while (!open.empty())
+        {
+            auto [d, k, i] = open.top();
+            open.pop();
+            if (d > limit)
+                return false;
+            if (k == 0)
+            {
+                *ret_x = i % occupancy_w[0];
+                *ret_y = i / occupancy_w[0];
+                return true;
+            }
+            int bx = i % occupancy_w[k];
+            int by = i / occupancy_w[k];
+            for (int c = 0; c < 4; c++)
+            {
+                int cx = bx * 2 + (c & 1);
+                int cy = by * 2 + (c >> 1);
+                if (cx >= occupancy_w[k - 1] || cy * occupancy_w[k - 1] + cx >= (int)occupancy[k - 1].size())
+                    continue;
+                int ci = cy * occupancy_w[k - 1] + cx;
+                if (occupancy[k - 1][ci] == 0)
+                    continue;
+                double ddx = WrappedGap(x, cx << (k - 1), std::min((double)((cx + 1) << (k - 1)), gw), gw);
+                double ddy = WrappedGap(y, cy << (k - 1), std::min((double)((cy + 1) << (k - 1)), gh), gh);
+                open.push({ ddx * ddx + ddy * ddy, k - 1, ci });
+            }
+        }
+        return false;
     }
 
-    // End game loop
-    void End()
+    // Ask for a path between two cells of the static collision layer, wrapping around the world
+    // Requests are handed to worker threads once per frame and solved with Jump Point Search. Moves are 8-way and never cut
+    // the corner of a blocking cell. A solved path is kept until one of the cells it crosses starts blocking it. A path found
+    // blocked is not watched, so call Repath when the game opens cells that might let it through
+    // int sx : Horizontal cell coordinate of the start
+    // int sy : Vertical cell coordinate of the start
+    // int gx : Horizontal cell coordinate of the goal
+    // int gy : Vertical cell coordinate of the goal
+    // Uint8 mask : Cell values that block the agent (a cell blocks when its value & mask is not 0)
+    // void (*on_change)(int) : Function to call with the path id when it is solved, found blocked or invalidated (can be nullptr)
+    int RequestPath(int sx, int sy, int gx, int gy, Uint8 mask = 0xFF, void (*on_change)(int) = nullptr)
     {
-        game_running = false;
+        int id = -1;
+        for (int i = 0; i < (int)paths.size(); i++)
+        {
+            if (!paths[i].in_use)
+            {
+                id = i;
+                break;
+            }
+        }
+        if (id < 0)
+        {
+            id = paths.size();
+            paths.insert(paths.end(), path_entry());
+        }
+        unsigned serial = paths[id].serial;
+        paths[id] = path_entry();
+        paths[id].in_use = true;
+        paths[id].serial = serial;
+        paths[id].on_change = on_change;
+        QueuePath(id, sx, sy, gx, gy, mask);
+        return id;
     }
 
-    // Delta time syncing function
-    double DeltaTime()
+    // Ask for a path again from a new start, keeping its id, goal and mask
+    // int id : Path id
+    // int sx : Horizontal cell coordinate of the new start
+    // int sy : Vertical cell coordinate of the new start
+    void Repath(int id, int sx, int sy)
     {
-        // Return the delta time. If the frame time is equal to the ideal frame length, then this will be zero
-        double t = ((frame_time * 1.0) / (frame_length * 1.0));
-        return t;
+        if (id < 0 || id >= (int)paths.size() || !paths[id].in_use)
+            return;
+        QueuePath(id, sx, sy, paths[id].gx, paths[id].gy, paths[id].mask);
     }
 
-    // Get current fps
-    int fps_now()
+    // Get where a path request is (path_none if the id is not in use)
+    // int id : Path id
+    path_state GetPathState(int id)
     {
-        return current_fps;
+        if (id < 0 || id >= (int)paths.size() || !paths[id].in_use)
+            return path_none;
+        return paths[id].state;
     }
 
-    // Change Font
-    // string fpth : Path to the font file
-    void ChangeFont(std::string fpth)
+    // Get the cells of a solved path from the start to the goal. Returns false if the path is not solved
+    // int id : Path id
+    // std::vector<SDL_Point>& out : Vector to fill with cell coordinates
+    // bool every_cell : List every cell crossed rather than only the cells where the path turns
+    bool GetPath(int id, std::vector<SDL_Point>& out, bool every_cell = false)
     {
-        // Create font
-        const char* fp = fpth.c_str();
-        sans = TTF_OpenFont(fp, font_h);
+        out.clear();
+        if (GetPathState(id) != path_found)
+            return false;
+        if (!every_cell)
+        {
+            out = paths[id].points;
+            return true;
+        }
+        for (int c : paths[id].cells)
+            out.insert(out.end(), SDL_Point{ c % (canvas_w * 2), c / (canvas_w * 2) });
+        return true;
     }
 
-    // Get the width of the font grid
-    int GetFontW()
+    // Drop a path and free its id
+    // int id : Path id
+    void ReleasePath(int id)
     {
-        return font_w;
+        if (id < 0 || id >= (int)paths.size() || !paths[id].in_use)
+            return;
+        UnwatchPath(id);
+        paths[id].in_use = false;
+        paths[id].state = path_none;
+        paths[id].serial++;
+        paths[id].points.clear();
+        paths[id].cells.clear();
     }
 
-    // Get the height of the font grid
-    int GetFontH()
+    // Add a flow field that leads every cell of the static collision layer to a shared goal, wrapping around the world
+    // Meant for crowds heading to the same place: agents look up their next step in O(1) instead of searching. Fields are
+    // built on worker threads when their goal moves and repaired on the main thread around static cells that change
+    // Uint8 mask : Cell values that block the agents (a cell blocks when its value & mask is not 0)
+    int AddFlowField(Uint8 mask = 0xFF)
     {
-        return font_h;
+        int id = -1;
+        for (int i = 0; i < (int)flow_fields.size(); i++)
+        {
+            if (!flow_fields[i].in_use)
+            {
+                id = i;
+                break;
+            }
+        }
+        if (id < 0)
+        {
+            id = flow_fields.size();
+            flow_fields.insert(flow_fields.end(), flow_field());
+        }
+        flow_fields[id] = flow_field();
+        flow_fields[id].in_use = true;
+        flow_fields[id].mask = mask;
+        return id;
     }
 
-    // Get the width of the font grid
-    int GetScreenW()
+    // Remove a flow field (waits for its build if one is running)
+    // int id : Flow field id
+    void RemoveFlowField(int id)
     {
-        return scr_w;
+        if (id < 0 || id >= (int)flow_fields.size() || !flow_fields[id].in_use)
+            return;
+        flow_fields[id] = flow_field();
     }
 
-    // Get the height of the font grid
-    int GetScreenH()
+    // Move the goal of a flow field. The field is rebuilt in the background and keeps leading to the old goal until then
+    // int id : Flow field id
+    // int x : Horizontal cell coordinate of the goal
+    // int y : Vertical cell coordinate of the goal
+    void SetFlowGoal(int id, int x, int y)
     {
-        return scr_h;
+        if (id < 0 || id >= (int)flow_fields.size() || !flow_fields[id].in_use)
+            return;
+        int goal = WrapCellY(y) * canvas_w * 2 + WrapCellX(x);
+        if (goal == flow_fields[id].goal)
+            return;
+        flow_fields[id].goal = goal;
+        flow_fields[id].rebuild = true;
     }
 
-    // Get elapsed_frames
-    long GetElapsedFrames()
+    // Check if a flow field has been built at least once
+    // int id : Flow field id
+    bool IsFlowFieldReady(int id)
     {
-        return elapsed_frames;
+        return id >= 0 && id < (int)flow_fields.size() && flow_fields[id].in_use && !flow_fields[id].cost.empty();
     }
 
-    // Handle input
-    // SDL_Scancode sdlKey : Keycode to check state
-    bool GetKeyState(SDL_Scancode sdlKey)
+    // Get the step an agent on a cell should take toward the goal of a flow field
+    // Returns false if the field is not ready, the cell cannot reach the goal or the cell is the goal
+    // int id : Flow field id
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    // int* ret_dx : Pointer to store the horizontal step (-1, 0 or 1)
+    // int* ret_dy : Pointer to store the vertical step (-1, 0 or 1)
+    bool GetFlowDirection(int id, int x, int y, int* ret_dx, int* ret_dy)
     {
-        SDL_PumpEvents();
-        if (keyboard_keys[sdlKey])
-            return true;
-        else
+        if (!IsFlowFieldReady(id))
+            return false;
+        char d = flow_fields[id].dir[WrapCellY(y) * canvas_w * 2 + WrapCellX(x)];
+        if (d == 4)
             return false;
+        *ret_dx = d / 3 - 1;
+        *ret_dy = d % 3 - 1;
+        return true;
     }
 
-    // Handle mouse input
-    // SDL_MouseButtonFlags sdlButton : Button to check state
-    bool GetMouseButtonState(SDL_MouseButtonFlags sdlButton)
+    // Get the distance from a cell to the goal of a flow field in cells (INFINITY if it cannot reach the goal or the field is not ready)
+    // Diagonal steps count as 1.4 cells
+    // int id : Flow field id
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    float GetFlowDistance(int id, int x, int y)
     {
-        SDL_MouseButtonFlags Buttons{ SDL_GetMouseState(NULL, NULL) };
-        if (Buttons & SDL_BUTTON_MASK(sdlButton))
-            return true;
-        else
-            return false;
+        if (!IsFlowFieldReady(id))
+            return INFINITY;
+        int c = flow_fields[id].cost[WrapCellY(y) * canvas_w * 2 + WrapCellX(x)];
+        return c == INT_MAX ? INFINITY : c / 10.0f;
+    }
+
+    // Compute which cells can be seen from a cell with symmetric shadowcasting, wrapping around the world
+    // Matching cells are seen but hide what is behind them. Sight is symmetric: an open cell sees another open cell exactly
+    // when that cell sees it back. The bits of the map are reused, so keep one map per actor and pass it every turn
+    // int x : Horizontal cell coordinate of the origin
+    // int y : Vertical cell coordinate of the origin
+    // int radius : Sight radius in cells
+    // fov_map& fov : Map to fill
+    // Uint8 mask : Collision bits that block sight
+    // int layers : Layers to look in (query_stat, query_dyn or query_both)
+    void ComputeFOV(int x, int y, int radius, fov_map& fov, Uint8 mask, int layers = query_both)
+    {
+        fov.origin_x = WrapCellX(x);
+        fov.origin_y = WrapCellY(y);
+        fov.radius = std::max(radius, 0);
+        fov.side = fov.radius * 2 + 1;
+        fov.words = (fov.side + 63) / 64;
+        fov.bits.assign(fov.words * fov.side, 0);
+        MarkFOV(fov, 0, 0);
+        // Slopes are kept as fractions so the scan is exact
+        for (int q = 0; q < 4; q++)
+            CastFOVQuadrant(fov, q, 1, -1, 1, 1, 1, mask, layers);
+    }
+
+    // Check if a cell was seen in a field of view
+    // const fov_map& fov : Map filled by ComputeFOV
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    bool IsInFOV(const fov_map& fov, int x, int y)
+    {
+        if (fov.radius < 0)
+            return false;
+        int gw = canvas_w * 2;
+        int gh = canvas_h * 2;
+        int r = fov.radius;
+        // A large radius can reach the same cell from more than one side of the world
+        for (int ox = WrapCellX(x - fov.origin_x) - (r / gw + 1) * gw; ox <= r; ox += gw)
+        {
+            if (ox < -r)
+                continue;
+            for (int oy = WrapCellY(y - fov.origin_y) - (r / gh + 1) * gh; oy <= r; oy += gh)
+            {
+                if (oy < -r)
+                    continue;
+                int bx = ox + r;
+                if (fov.bits[(oy + r) * fov.words + bx / 64] >> (bx % 64) & 1)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Check if two cells can see each other, the short way around the world
+    // Walks the cells the line between the two centres passes through. The cells themselves never block, and a line through
+    // a corner is only blocked when both cells beside the corner block. The answer is the same whichever way round the cells are given
+    // int sx : Horizontal cell coordinate of the first cell
+    // int sy : Vertical cell coordinate of the first cell
+    // int tx : Horizontal cell coordinate of the second cell
+    // int ty : Vertical cell coordinate of the second cell
+    // Uint8 mask : Collision bits that block sight
+    // int layers : Layers to look in (query_stat, query_dyn or query_both)
+    bool HasLineOfSight(int sx, int sy, int tx, int ty, Uint8 mask, int layers = query_both)
+    {
+        int gw = canvas_w * 2;
+        int gh = canvas_h * 2;
+        sx = WrapCellX(sx);
+        sy = WrapCellY(sy);
+        tx = WrapCellX(tx);
+        ty = WrapCellY(ty);
+        // Always cast from the same end so sight is symmetric
+        if (ty * gw + tx < sy * gw + sx)
+        {
+            std::swap(sx, tx);
+            std::swap(sy, ty);
+        }
+        if (sx == tx && sy == ty)
+            return true;
+        int dx = tx - sx;
+        int dy = ty - sy;
+        if (abs(dx) > gw / 2)
+            dx -= dx > 0 ? gw : -gw;
+        if (abs(dy) > gh / 2)
+            dy -= dy > 0 ? gh : -gh;
+        if ((layers & query_both) == query_stat)
+        {
+            // Nothing solid within reach of the line according to the distance field
+            if (distance_enabled && distance_changed.empty())
+            {
+                std::shared_lock<std::shared_mutex> lock(distance_mutex);
+                double reach = sqrt((double)dx * dx + (double)dy * dy) + 1;
+                if (distance_sq[sy * gw + sx] > reach * reach)
+                    return true;
+            }
+            // Nothing solid in the box around the line according to the occupancy pyramid
+            if (!occupancy.empty() && CountOccupancy(std::min(sx, sx + dx), std::min(sy, sy + dy), abs(dx) + 1, abs(dy) + 1, 1) == 0)
+                return true;
+        }
+        // Integer walk - the sign of side says whether the line crosses a vertical or horizontal edge next (0 = a corner)
+        int nx = abs(dx);
+        int ny = abs(dy);
+        int step_x = dx > 0 ? 1 : -1;
+        int step_y = dy > 0 ? 1 : -1;
+        int x = sx;
+        int y = sy;
+        for (int ix = 0, iy = 0; ix < nx || iy < ny;)
+        {
+            int side = (1 + 2 * ix) * ny - (1 + 2 * iy) * nx;
+            if (side == 0)
+            {
+                if (CellMatches(x + step_x, y, mask, layers) && CellMatches(x, y + step_y, mask, layers))
+                    return false;
+                x += step_x;
+                y += step_y;
+                ix++;
+                iy++;
+            }
+            else if (side < 0)
+            {
+                x += step_x;
+                ix++;
+            }
+            else
+            {
+                y += step_y;
+                iy++;
+            }
+            if ((ix < nx || iy < ny) && CellMatches(x, y, mask, layers))
+                return false;
+        }
+        return true;
+    }
+
+    // Check line of sight for many pairs of cells at once
+    // const std::vector<SDL_Point>& from : First cell of each pair
+    // const std::vector<SDL_Point>& to : Second cell of each pair
+    // std::vector<char>& visible : Vector to fill with 1 for each pair that can see each other and 0 otherwise
+    // Uint8 mask : Collision bits that block sight
+    // int layers : Layers to look in (query_stat, query_dyn or query_both)
+    void LineOfSight(const std::vector<SDL_Point>& from, const std::vector<SDL_Point>& to, std::vector<char>& visible, Uint8 mask, int layers = query_both)
+    {
+        int n = std::min(from.size(), to.size());
+        visible.resize(n);
+        for (int i = 0; i < n; i++)
+            visible[i] = HasLineOfSight(from[i].x, from[i].y, to[i].x, to[i].y, mask, layers);
+    }
+
+    // Sweep a box through the collision grid and find where it first touches a matching cell
+    // Only the row or column the leading edge enters is checked at each cell boundary, so the cost follows the
+    // distance in cells, not the speed. The box wraps around the world. Cells the box already overlaps are ignored
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // double w : Width in collision cells
+    // double h : Height in collision cells
+    // double dx : Horizontal motion in collision cells
+    // double dy : Vertical motion in collision cells
+    // Uint8 mask : Collision bits that stop the box
+    // int layers : Layers to look in (query_stat, query_dyn or query_both)
+    collision_sweep SweepRect(double x, double y, double w, double h, double dx, double dy, Uint8 mask, int layers = query_both)
+    {
+        collision_sweep result;
+        // Next column and row the leading edges enter
+        int next_x = dx > 0 ? SpanHigh(x + w, 0) + 1 : SpanLow(x, 0) - 1;
+        int next_y = dy > 0 ? SpanHigh(y + h, 0) + 1 : SpanLow(y, 0) - 1;
+        while (true)
+        {
+            // Time the leading edge reaches the boundary of the next column or row
+            double tx = dx > 0 ? (next_x - (x + w)) / dx : dx < 0 ? (next_x + 1 - x) / dx : INFINITY;
+            double ty = dy > 0 ? (next_y - (y + h)) / dy : dy < 0 ? (next_y + 1 - y) / dy : INFINITY;
+            double t = std::max(std::min(tx, ty), 0.0);
+            if (t > 1)
+                return result;
+            collision_hit hit;
+            int nx = 0;
+            int ny = 0;
+            if (tx <= ty)
+            {
+                // The rows the box covers at that time, including one it is about to enter
+                double py = y + dy * t;
+                int y0 = SpanLow(py, dy);
+                int y1 = SpanHigh(py + h, dy);
+                hit = QueryRect(next_x, y0, 1, y1 - y0 + 1, mask, layers);
+                nx = dx > 0 ? -1 : 1;
+                next_x += dx > 0 ? 1 : -1;
+            }
+            else
+            {
+                double px = x + dx * t;
+                int x0 = SpanLow(px, dx);
+                int x1 = SpanHigh(px + w, dx);
+                hit = QueryRect(x0, next_y, x1 - x0 + 1, 1, mask, layers);
+                ny = dy > 0 ? -1 : 1;
+                next_y += dy > 0 ? 1 : -1;
+            }
+            if (hit.any)
+            {
+                result.hit = true;
+                result.toi = t;
+                result.cell_x = hit.first_x;
+                result.cell_y = hit.first_y;
+                result.normal_x = nx;
+                result.normal_y = ny;
+                return result;
+            }
+        }
+    }
+
+    // Gravity Engine Destructor
+    ~GravityEngine_Core()
+    {
+        // Stop the path workers
+        {
+            std::lock_guard<std::mutex> lock(path_mutex);
+            path_workers_stop = true;
+        }
+        path_wake.notify_all();
+        for (auto& t : path_workers)
+            t.join();
+
+        // Delete all of the layers
+        SDL_aligned_free(collision_static);
+        SDL_aligned_free(collision_dynamic);
+    }
+
+    // Start the video game
+    // void (*init_game)() : Custom game initialization function
+    // void (*pre_loop_code)() : Custom global begin-step function
+    // void (*post_loop_code)() : Custom global end-step function
+    SDL_AppResult Start(void (*init_game)() = nullptr, void (*pre_loop_code)() = nullptr, void (*post_loop_code)() = nullptr)
+    {
+        // Game is running now
+        game_running = true;
+
+        // Initialize SDL app meta data
+        SDL_SetAppMetadata(game_title, game_version, game_id);
+        // Initialize SDL library - The terminal backend has no window, so it does not need video
+        if (SDL_Init(backend == ansi_terminal ? SDL_INIT_AUDIO : SDL_INIT_VIDEO | SDL_INIT_AUDIO) == false)
+        {
+            std::cout << SDL_GetError() << std::endl;
+            std::system("pause");
+        }
+        // Create the SDL window
+        if (backend == ansi_terminal)
+            ;
+        else if (low_res)
+            SDL_CreateWindowAndRenderer(game_title, scr_w, scr_h, SDL_window_props, &window, &renderer);
+        else
+            SDL_CreateWindowAndRenderer(game_title, canvas_w * font_w, canvas_h * font_h, SDL_window_props, &window, &renderer);
+
+        // Load the audio spec
+        auto dev = SDL_OpenAudioDevice(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, NULL);
+        SDL_GetAudioDeviceFormat(dev, &global_audio_spec, nullptr);
+        SDL_CloseAudioDevice(dev);
+
+        // Initialize all audio channels
+        for (int i = 0; i < channels; i++)
+            audio_channels.insert(audio_channels.end(), new GravityEngine_AudioChannel(global_audio_spec));
+
+        // Create the frame the game is composited into when rendering at a low internal resolution
+        if (low_res && renderer != NULL)
+        {
+            present_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, render_w, render_h);
+            // The composited frame is upscaled with nearest scaling so pixels stay crisp
+            SDL_SetTextureScaleMode(present_texture, SDL_SCALEMODE_NEAREST);
+        }
+
+        // Create the engine used to write text
+        engine = TTF_CreateRendererTextEngine(renderer);
+
+        // Init SDL ttf
+        TTF_Init();
+
+        // Create font
+        const char* fp = font_path.c_str();
+        sans = TTF_OpenFont(fp, font_h);
+
+        // Call init custom user code
+        if (init_game != nullptr)
+            init_game();
+
+        // Call game loop
+        GameLoop(pre_loop_code, post_loop_code);
+
+        // -= GAME END =-
+        // Clenup goes here
+
+        // Give the terminal back in its normal state
+        if (terminal_started)
+        {
+            fputs("\x1b[0m\x1b[?25h\n", stdout);
+            fflush(stdout);
+        }
+
+        // Free the widget and character text before the text engine goes
+        for (auto& w : ui_widgets)
+            if (w.ttf_text != nullptr)
+                TTF_DestroyText(w.ttf_text);
+        for (auto& t : glyph_texts)
+            if (t != nullptr)
+                TTF_DestroyText(t);
+
+        // Free the engine's textures while the renderer is still alive
+        for (auto& s : sprite_list)
+            if (s.texture != nullptr)
+                SDL_DestroyTexture(s.texture);
+        for (auto& gl : layers)
+            if (gl.texture != nullptr)
+                SDL_DestroyTexture(gl.texture);
+        for (auto& g : draw_groups)
+            if (g.target.texture != nullptr)
+                SDL_DestroyTexture(g.target.texture);
+        for (SDL_Texture* t : { upload_texture, lit_texture, light_texture, minimap_texture, present_texture })
+            if (t != nullptr)
+                SDL_DestroyTexture(t);
+
+        // TTF Quit
+        TTF_DestroyRendererTextEngine(engine);
+        TTF_Quit();
+
+        // Free audio channels
+        for (auto ac : audio_channels)
+            delete ac;
+        for (auto s : sounds)
+            delete s;
+
+        // Kill SDL
+        SDL_Quit();
+
+        // Free all objects
+        for (auto o : entity_list)
+            delete o;
+
+        // Success!
+        return SDL_APP_SUCCESS;
+    }
+
+    // End game loop
+    void End()
+    {
+        game_running = false;
+    }
+
+    // Delta time syncing function
+    double DeltaTime()
+    {
+        // Return the delta time. If the frame time is equal to the ideal frame length, then this will be zero
+        double t = ((frame_time * 1.0) / (frame_length * 1.0));
+        return t;
+    }
+
+    // Get current fps
+    int fps_now()
+    {
+        return current_fps;
+    }
+
+    // Change Font
+    // string fpth : Path to the font file
+    void ChangeFont(std::string fpth)
+    {
+        // Create font
+        const char* fp = fpth.c_str();
+        sans = TTF_OpenFont(fp, font_h);
+        // Lay the widget text out again in the new font
+        for (auto& w : ui_widgets)
+        {
+            if (!w.in_use || w.ttf_text == nullptr)
+                continue;
+            TTF_SetTextFont(w.ttf_text, sans);
+            ui_damage.insert(ui_damage.end(), w.area);
+        }
+        for (auto t : glyph_texts)
+            if (t != nullptr)
+                TTF_SetTextFont(t, sans);
+    }
+
+    // Get the width of the font grid
+    int GetFontW()
+    {
+        return font_w;
+    }
+
+    // Get the height of the font grid
+    int GetFontH()
+    {
+        return font_h;
+    }
+
+    // Get the width of the screen in drawing units (the internal resolution when SetInternalResolution is used)
+    int GetScreenW()
+    {
+        return render_w;
+    }
+
+    // Get the height of the screen in drawing units (the internal resolution when SetInternalResolution is used)
+    int GetScreenH()
+    {
+        return render_h;
+    }
+
+    // Render at a fixed low internal resolution and integer upscale it to the window when presenting
+    // All layers and compositing run at this size. Call this before Start
+    // int w : Internal width in pixels (e.g. 480)
+    // int h : Internal height in pixels (e.g. 270)
+    void SetInternalResolution(int w, int h)
+    {
+        if (game_running || w <= 0 || h <= 0)
+            return;
+        render_w = w;
+        render_h = h;
+        low_res = w != scr_w || h != scr_h;
+        viewports[0].rect = { 0, 0, (float)render_w, (float)render_h };
+        // Auto-detected font dims follow the internal resolution
+        if (font_w_auto)
+            font_w = (int)(floor(render_w / canvas_w));
+        if (font_h_auto)
+            font_h = (int)(floor(render_h / canvas_h));
+    }
+
+    // Get the integer factor the internal resolution is upscaled by (1 when rendering at the screen resolution)
+    int GetPresentScale()
+    {
+        if (!low_res)
+            return 1;
+        return std::max(1, (int)(GetPresentRect()->w / render_w));
+    }
+
+    // Let the engine lower the render resolution of the world layers when compositing runs over budget
+    // Sprite and rectangle coordinates stay in logical units at every scale
+    // double budget_ms : Compositing time budget per frame in milliseconds
+    // float min_scale : Lowest render scale allowed
+    // float max_scale : Highest render scale allowed
+    // float step : Amount the scale changes per adjustment
+    void EnableDynamicResolution(double budget_ms, float min_scale = 0.5f, float max_scale = 1.f, float step = 0.125f)
+    {
+        dynamic_resolution = true;
+        drs_budget = (int64_t)(budget_ms * 1000000);
+        drs_min_scale = std::clamp(min_scale, 0.125f, 1.f);
+        drs_max_scale = std::clamp(max_scale, drs_min_scale, 1.f);
+        drs_step = step;
+        drs_cooldown = 0;
+    }
+
+    // Stop adjusting the render scale and go back to full resolution
+    void DisableDynamicResolution()
+    {
+        dynamic_resolution = false;
+        if (renderer != NULL)
+            SetRenderScale(1.f);
+        else
+            render_scale = 1.f;
+    }
+
+    // Get the current render scale of the world layers
+    float GetRenderScale()
+    {
+        return render_scale;
+    }
+
+    // Get the time it took to composite and present the last frame in nanoseconds
+    int64_t GetCompositeTime()
+    {
+        return composite_time;
+    }
+
+    // Get elapsed_frames
+    long GetElapsedFrames()
+    {
+        return elapsed_frames;
+    }
+
+    // Handle input
+    // SDL_Scancode sdlKey : Keycode to check state
+    bool GetKeyState(SDL_Scancode sdlKey)
+    {
+        SDL_PumpEvents();
+        if (keyboard_keys[sdlKey])
+            return true;
+        else
+            return false;
+    }
+
+    // Handle mouse input
+    // SDL_MouseButtonFlags sdlButton : Button to check state
+    bool GetMouseButtonState(SDL_MouseButtonFlags sdlButton)
+    {
+        SDL_MouseButtonFlags Buttons{ SDL_GetMouseState(NULL, NULL) };
+        if (Buttons & SDL_BUTTON_MASK(sdlButton))
+            return true;
+        else
+            return false;
     }
 
     // Handle mouse wheel
     int GetMouseWheelState()
     {
-        return mouse_wheel_state;
+        return mouse_wheel_state;
+    }
+
+    // Handle mouse location
+    // float* ret_x : Pointer to store the horizontal position
+    // float* ret_y : Pointer to store the vertical position
+    void GetMousePosition(float* ret_x, float* ret_y)
+    {
+        float x, y;
+        SDL_GetMouseState(&x, &y);
+
+        if (low_res)
+        {
+            // Map the window position into the upscaled internal frame
+            SDL_RenderCoordinatesFromWindow(renderer, x, y, &x, &y);
+            const SDL_FRect* pr = GetPresentRect();
+            *ret_x = ((x - pr->x) / pr->w) * canvas_w;
+            *ret_y = ((y - pr->y) / pr->h) * canvas_h;
+            return;
+        }
+
+        *ret_x = (x / scr_w) * canvas_w;
+        *ret_y = (y / scr_h) * canvas_h;
+    }
+
+    // Get a random number - https://www.geeksforgeeks.org/cpp/how-to-generate-random-number-in-range-in-cpp/
+    // int min : Minimum number to get random value in 
+    // int max : Maximum number to get random value in 
+    int RandRange(int min, int max)
+    {
+        // Initialize a random number generator
+        std::random_device rd;
+        std::mt19937 gen(rd());
+        std::uniform_int_distribution<> distrib(min, max);
+        // Return value
+        return distrib(gen);
+    }
+
+    // Add the object to the entity list
+    // GravityEngine_Object* object : Gravity engine managed object reference
+    int AddObject(GravityEngine_Object* object)
+    {
+        entity_list.insert(entity_list.end(), object);
+        return entity_list.size() - 1;
+    }
+
+    // Remove the object from the entity list
+    // GravityEngine_Object* object : Gravity engine managed object reference
+    void RemoveObject(GravityEngine_Object* object)
+    {
+        std::erase(entity_list, object);
+    }
+
+    // Add the sprite to the sprite list
+    // Loading a path that is already resident returns the same handle and adds a reference to it. A handle holds the slot
+    // and its generation, so a handle kept after its sprite was evicted is ignored rather than reaching the slot's next sprite
+    // const char* sprite_path : File path to the sprite to be loaded
+    // SDL_ScaleMode scale_mode : Antialiasing type (only applied when the sprite is first loaded)
+    int AddSprite(const char* sprite_path, SDL_ScaleMode scale_mode = SDL_SCALEMODE_NEAREST)
+    {
+        // Reuse the sprite if this path is already loaded
+        auto found = sprite_paths.find(sprite_path);
+        if (found != sprite_paths.end())
+        {
+            sprite_list[found->second].ref_count++;
+            sprite_list[found->second].last_used = elapsed_frames;
+            return found->second | sprite_list[found->second].generation << 16;
+        }
+        // Load the texture
+        auto sprite = IMG_Load(sprite_path);
+        if (sprite == NULL)
+        {
+            std::cout << SDL_GetError() << std::endl;
+            return -1;
+        }
+        auto texture = SDL_CreateTextureFromSurface(renderer, sprite);
+        SDL_DestroySurface(sprite);
+        if (texture == NULL)
+        {
+            std::cout << SDL_GetError() << std::endl;
+            return -1;
+        }
+        SDL_SetTextureScaleMode(texture, scale_mode);
+        // Take a free slot if there is one, otherwise grow the list
+        int index;
+        if (!sprite_free_slots.empty())
+        {
+            index = sprite_free_slots.back();
+            sprite_free_slots.pop_back();
+        }
+        else
+        {
+            index = sprite_list.size();
+            sprite_list.insert(sprite_list.end(), sprite_resource());
+        }
+        sprite_resource& res = sprite_list[index];
+        res.texture = texture;
+        res.path = sprite_path;
+        res.ref_count = 1;
+        res.bytes = (size_t)texture->w * texture->h * SDL_BYTESPERPIXEL(texture->format);
+        res.last_used = elapsed_frames;
+        sprite_paths[res.path] = index;
+        sprite_memory_used += res.bytes;
+        int handle = index | res.generation << 16;
+        // Keep the resident set inside the budget
+        TrimSprites();
+        return handle;
+    }
+
+    // Release a handle to a sprite in the sprite list
+    // The texture stays resident while the memory budget allows, so loading the same path again is free
+    // int handle : Sprite handle returned by AddSprite
+    void DeleteSprite(int handle)
+    {
+        int index = GetSpriteSlot(handle);
+        if (index < 0 || sprite_list[index].ref_count <= 0)
+            return;
+        sprite_list[index].ref_count--;
+        // Evict unreferenced textures that do not fit in the budget
+        TrimSprites();
+    }
+
+    // Set the texture memory budget for sprites
+    // Unreferenced sprites are evicted least recently used first until the resident total fits the budget
+    // size_t bytes : Budget in bytes (0 = free sprites as soon as they are no longer referenced)
+    void SetSpriteMemoryBudget(size_t bytes)
+    {
+        sprite_memory_budget = bytes;
+        TrimSprites();
+    }
+
+    // Get the texture memory used by all resident sprites in bytes
+    size_t GetSpriteMemoryUsage()
+    {
+        return sprite_memory_used;
+    }
+
+    // Get the texture memory used by one sprite in bytes (0 if the sprite is not resident)
+    // int handle : Sprite handle returned by AddSprite
+    size_t GetSpriteBytes(int handle)
+    {
+        int index = GetSpriteSlot(handle);
+        if (index < 0)
+            return 0;
+        return sprite_list[index].bytes;
+    }
+
+    // Get the number of handles currently held on a sprite
+    // int handle : Sprite handle returned by AddSprite
+    int GetSpriteRefCount(int handle)
+    {
+        int index = GetSpriteSlot(handle);
+        if (index < 0)
+            return 0;
+        return sprite_list[index].ref_count;
+    }
+
+    // Draw a sprite at a location
+    // int handle : Sprite handle returned by AddSprite
+    // double x : Horizontal position of sprite
+    // double y : Vertical position of sprite
+    // double w_scale : Horizontal scaling of sprite
+    // double H_scale : Vertical scaling of sprite
+    // sprite_layer l : Layer to draw the sprite on
+    void DrawSprite(int handle, double x, double y, double w_scale, double h_scale, sprite_layer l)
+    {
+        // Ignore handles that do not point to a resident sprite
+        int index = GetSpriteSlot(handle);
+        if (index < 0)
+            return;
+        SDL_Texture* sprite = sprite_list[index].texture;
+        sprite_list[index].last_used = elapsed_frames;
+        // Queue on the target layer's batch
+        graphic_layer* gl = GetLayerBatch(l, sprite);
+        if (gl == nullptr)
+            return;
+        // Get the dimensions of the character
+        float w, h;
+        SDL_GetTextureSize(sprite, &w, &h);
+        // Create an FRect to draw to
+        SDL_FRect dst = { x, y, w * w_scale, h * w_scale };
+        // Queue the sprite on the graphical layer
+        BatchRect(*gl, dst, { 1, 1, 1, 1 });
+        // Re-render if wrap
+        if (x + w * w_scale > render_w * 2)
+        {
+            // Create an FRect to draw to
+            SDL_FRect dst_w = { x - render_w * 2, y, w * w_scale, h * w_scale };
+            // Queue the sprite on the graphical layer
+            BatchRect(*gl, dst_w, { 1, 1, 1, 1 });
+        }
+        if (y + h * h_scale > render_h * 2)
+        {
+            // Create an FRect to draw to
+            SDL_FRect dst_w = { x, y - render_h * 2, w * w_scale, h * w_scale };
+            // Queue the sprite on the graphical layer
+            BatchRect(*gl, dst_w, { 1, 1, 1, 1 });
+        }
+        if (y + h * h_scale > render_h * 2 && x + w * w_scale > render_w * 2)
+        {
+            // Create an FRect to draw to
+            SDL_FRect dst_w = { x - render_w * 2, y - render_h * 2, w * w_scale, h * w_scale };
+            // Queue the sprite on the graphical layer
+            BatchRect(*gl, dst_w, { 1, 1, 1, 1 });
+        }
+        if (x < 0 && y < 0)
+        {
+            // Create an FRect to draw to
+            SDL_FRect dst_w = { x + render_w * 2, y + render_h * 2, w * w_scale, h * w_scale };
+            // Queue the sprite on the graphical layer
+            BatchRect(*gl, dst_w, { 1, 1, 1, 1 });
+        }
+        if (x < 0)
+        {
+            // Create an FRect to draw to
+            SDL_FRect dst_w = { x + render_w * 2, y, w * w_scale, h * w_scale };
+            // Queue the sprite on the graphical layer
+            BatchRect(*gl, dst_w, { 1, 1, 1, 1 });
+        }
+        if (y < 0)
+        {
+            // Create an FRect to draw to
+            SDL_FRect dst_w = { x, y + render_h * 2, w * w_scale, h * w_scale };
+            // Queue the sprite on the graphical layer
+            BatchRect(*gl, dst_w, { 1, 1, 1, 1 });
+        }
+        // Notofy the drawing pipeline that a change has been made
+        screen_updated = true;
+    }
+
+    // Draw a rectangle
+    // double x : Horizontal position of the rectangle
+    // double y : Vertical position of the rectangle
+    // double w : Width of the rectangle
+    // double h : Height of the rectangle
+    // SDL_Color c : Fill color
+    // sprite_layer l : Layer to draw the rectangle on
+    void DrawRect(double x, double y, double w, double h, SDL_Color c, sprite_layer l)
+    {
+        // Indexed layers draw with the closest palette entry
+        if (recording_group < 0 && l >= 0 && l < (int)layers.size() && layers[l].indexed)
+        {
+            DrawRectIndexed(x, y, w, h, FindPaletteIndex(layers[l], c), l);
+            return;
+        }
+        // Queue on the target layer's batch
+        graphic_layer* gl = GetLayerBatch(l, nullptr);
+        if (gl == nullptr)
+            return;
+        // Create an FRect to draw to
+        SDL_FRect fr = { x, y, w, h };
+        // Fill the rectangle with color
+        BatchRect(*gl, fr, ToFColor(c));
+        // Notify the drawing pipeline that a change has been made
+        screen_updated = true;
+    }
+
+    // Draw the outline of a rectangle
+    // double x : Horizontal position of the rectangle
+    // double y : Vertical position of the rectangle
+    // double w : Width of the rectangle
+    // double h : Height of the rectangle
+    // double thickness : Width of the outline (drawn inside the rectangle)
+    // SDL_Color c : Outline color
+    // sprite_layer l : Layer to draw the outline on
+    void DrawRectOutline(double x, double y, double w, double h, double thickness, SDL_Color c, sprite_layer l)
+    {
+        thickness = std::min(thickness, std::min(w, h) / 2);
+        // Indexed layers draw with the closest palette entry
+        if (recording_group < 0 && l >= 0 && l < (int)layers.size() && layers[l].indexed)
+        {
+            Uint8 index = FindPaletteIndex(layers[l], c);
+            DrawRectIndexed(x, y, w, thickness, index, l);
+            DrawRectIndexed(x, y + h - thickness, w, thickness, index, l);
+            DrawRectIndexed(x, y + thickness, thickness, h - thickness * 2, index, l);
+            DrawRectIndexed(x + w - thickness, y + thickness, thickness, h - thickness * 2, index, l);
+            return;
+        }
+        graphic_layer* gl = GetLayerBatch(l, nullptr);
+        if (gl == nullptr)
+            return;
+        SDL_FColor fc = ToFColor(c);
+        // Top and bottom span the full width, the sides fill the gap between them
+        BatchRect(*gl, { (float)x, (float)y, (float)w, (float)thickness }, fc);
+        BatchRect(*gl, { (float)x, (float)(y + h - thickness), (float)w, (float)thickness }, fc);
+        BatchRect(*gl, { (float)x, (float)(y + thickness), (float)thickness, (float)(h - thickness * 2) }, fc);
+        BatchRect(*gl, { (float)(x + w - thickness), (float)(y + thickness), (float)thickness, (float)(h - thickness * 2) }, fc);
+        screen_updated = true;
+    }
+
+    // Draw a line
+    // double x1 : Horizontal position of the start
+    // double y1 : Vertical position of the start
+    // double x2 : Horizontal position of the end
+    // double y2 : Vertical position of the end
+    // double thickness : Width of the line
+    // SDL_Color c : Line color
+    // sprite_layer l : Layer to draw the line on
+    void DrawLine(double x1, double y1, double x2, double y2, double thickness, SDL_Color c, sprite_layer l)
+    {
+        // Indexed layers draw with the closest palette entry
+        if (recording_group < 0 && l >= 0 && l < (int)layers.size() && layers[l].indexed)
+        {
+            FillLineIndexed({ (float)x1, (float)y1 }, { (float)x2, (float)y2 }, thickness, FindPaletteIndex(layers[l], c), l);
+            return;
+        }
+        graphic_layer* gl = GetLayerBatch(l, nullptr);
+        if (gl == nullptr)
+            return;
+        BatchLine(*gl, { (float)x1, (float)y1 }, { (float)x2, (float)y2 }, thickness, ToFColor(c));
+        screen_updated = true;
+    }
+
+    // Draw a circle
+    // double x : Horizontal position of the centre
+    // double y : Vertical position of the centre
+    // double r : Radius
+    // SDL_Color c : Circle color
+    // sprite_layer l : Layer to draw the circle on
+    // bool filled : Fill the circle (false = outline only)
+    // double thickness : Width of the outline (drawn inside the radius)
+    void DrawCircle(double x, double y, double r, SDL_Color c, sprite_layer l, bool filled = true, double thickness = 1)
+    {
+        if (r <= 0)
+            return;
+        float inner = filled ? 0 : std::max(0., r - thickness);
+        // Indexed layers draw with the closest palette entry
+        if (recording_group < 0 && l >= 0 && l < (int)layers.size() && layers[l].indexed)
+        {
+            // Fill the pixels whose centres fall between the inner and outer radius, row by row
+            Uint8 index = FindPaletteIndex(layers[l], c);
+            for (int q = (int)floor(y - r); q < (int)ceil(y + r); q++)
+            {
+                double dy = q + 0.5 - y;
+                if (fabs(dy) >= r)
+                    continue;
+                double outer_w = sqrt(r * r - dy * dy);
+                double inner_w = fabs(dy) < inner ? sqrt(inner * inner - dy * dy) : 0;
+                int o0 = (int)ceil(x - outer_w - 0.5);
+                int o1 = (int)ceil(x + outer_w - 0.5);
+                if (inner_w == 0)
+                {
+                    DrawRectIndexed(o0, q, o1 - o0, 1, index, l);
+                    continue;
+                }
+                int i0 = (int)ceil(x - inner_w - 0.5);
+                int i1 = (int)ceil(x + inner_w - 0.5);
+                DrawRectIndexed(o0, q, i0 - o0, 1, index, l);
+                DrawRectIndexed(i1, q, o1 - i1, 1, index, l);
+            }
+            return;
+        }
+        graphic_layer* gl = GetLayerBatch(l, nullptr);
+        if (gl == nullptr)
+            return;
+        SDL_FColor fc = ToFColor(c);
+        // Enough segments that each edge is a few pixels long
+        int segments = std::clamp((int)ceil(2 * PI * r / 4), 12, 128);
+        int first = gl->batch_vertices.size();
+        if (filled)
+            BatchVertex(*gl, { (float)x, (float)y }, fc);
+        for (int i = 0; i < segments; i++)
+        {
+            float a = 2 * PI * i / segments;
+            BatchVertex(*gl, { (float)(x + cos(a) * r), (float)(y + sin(a) * r) }, fc);
+            if (!filled)
+                BatchVertex(*gl, { (float)(x + cos(a) * inner), (float)(y + sin(a) * inner) }, fc);
+        }
+        for (int i = 0; i < segments; i++)
+        {
+            int next = (i + 1) % segments;
+            if (filled)
+            {
+                // Triangle fan around the centre
+                BatchTriangle(*gl, first, first + 1 + i, first + 1 + next);
+            }
+            else
+            {
+                // Ring of quads between the outer and inner edge
+                BatchTriangle(*gl, first + i * 2, first + next * 2, first + i * 2 + 1);
+                BatchTriangle(*gl, first + next * 2, first + next * 2 + 1, first + i * 2 + 1);
+            }
+        }
+        screen_updated = true;
+    }
+
+    // Draw a convex polygon
+    // Nothing is drawn for fewer than 3 corners when filled or 2 corners as an outline
+    // const std::vector<SDL_FPoint>& points : Corners of the polygon in order
+    // SDL_Color c : Polygon color
+    // sprite_layer l : Layer to draw the polygon on
+    // bool filled : Fill the polygon (false = outline only)
+    // double thickness : Width of the outline
+    void DrawPolygon(const std::vector<SDL_FPoint>& points, SDL_Color c, sprite_layer l, bool filled = true, double thickness = 1)
+    {
+        if ((int)points.size() < (filled ? 3 : 2))
+            return;
+        // Indexed layers draw with the closest palette entry
+        if (recording_group < 0 && l >= 0 && l < (int)layers.size() && layers[l].indexed)
+        {
+            Uint8 index = FindPaletteIndex(layers[l], c);
+            if (filled)
+                FillConvexIndexed(points, index, l);
+            else
+                for (int i = 0; i < (int)points.size(); i++)
+                    FillLineIndexed(points[i], points[(i + 1) % points.size()], thickness, index, l);
+            return;
+        }
+        graphic_layer* gl = GetLayerBatch(l, nullptr);
+        if (gl == nullptr)
+            return;
+        SDL_FColor fc = ToFColor(c);
+        if (filled)
+        {
+            // Convex polygons are a triangle fan from the first corner
+            int first = gl->batch_vertices.size();
+            for (auto& p : points)
+                BatchVertex(*gl, p, fc);
+            for (int i = 1; i + 1 < (int)points.size(); i++)
+                BatchTriangle(*gl, first, first + i, first + i + 1);
+        }
+        else
+        {
+            for (int i = 0; i < (int)points.size(); i++)
+                BatchLine(*gl, points[i], points[(i + 1) % points.size()], thickness, fc);
+        }
+        screen_updated = true;
+    }
+
+    // Add a layer to the layer stack
+    // The layer costs nothing until something is drawn on it
+    // int z : Composite order (background 0, entity 100, foreground 200, ui 300, debug 400)
+    // bool world : Layer scrolls with the camera and wraps around the world (false = fixed to the screen)
+    // float parallax_x : Horizontal camera follow factor (1 = moves with the world, 0 = fixed)
+    // float parallax_y : Vertical camera follow factor (1 = moves with the world, 0 = fixed)
+    sprite_layer AddLayer(int z, bool world = true, float parallax_x = 1.f, float parallax_y = 1.f)
+    {
+        // Reuse a removed slot if there is one
+        int index = layers.size();
+        for (int i = debug + 1; i < (int)layers.size(); i++)
+        {
+            if (!layers[i].in_use)
+            {
+                index = i;
+                break;
+            }
+        }
+        if (index == (int)layers.size())
+            layers.resize(layers.size() + 1);
+        SetupLayer((sprite_layer)index, z, world, false);
+        layers[index].parallax_x = parallax_x;
+        layers[index].parallax_y = parallax_y;
+        return (sprite_layer)index;
+    }
+
+    // Get a buffer to write a region of a layer directly, pixel by pixel or cell by cell
+    // The buffer is ARGB8888 (0xAARRGGBB) and write-only - its starting contents are undefined, so fill every pixel.
+    // UnlockLayerRegion uploads it in one go, replacing what was in the region. Returns nullptr if the region cannot be locked
+    // sprite_layer l : Layer to write (indexed layers have their own index buffer)
+    // int x : Horizontal position of the region (pixels, or cells if cells is set)
+    // int y : Vertical position of the region (pixels, or cells if cells is set)
+    // int w : Width of the region (pixels, or cells if cells is set)
+    // int h : Height of the region (pixels, or cells if cells is set)
+    // int* pitch : Pointer to store the number of Uint32 per buffer row
+    // bool cells : One buffer entry per font cell, stretched to fill the cell on upload
+    Uint32* LockLayerRegion(sprite_layer l, int x, int y, int w, int h, int* pitch, bool cells = false)
+    {
+        if (upload_layer >= 0 || renderer == NULL || l < 0 || l >= (int)layers.size() || !layers[l].in_use || layers[l].indexed || w <= 0 || h <= 0)
+            return nullptr;
+        // The region has to lie on the layer
+        int lw = layers[l].world ? render_w * 2 : render_w;
+        int lh = layers[l].world ? render_h * 2 : render_h;
+        SDL_FRect dst = { (float)x, (float)y, (float)w, (float)h };
+        if (cells)
+            dst = { (float)(x * font_w), (float)(y * font_h), (float)(w * font_w), (float)(h * font_h) };
+        if (dst.x < 0 || dst.y < 0 || dst.x + dst.w > lw || dst.y + dst.h > lh)
+            return nullptr;
+        // One streaming texture the size of the world is shared by every upload
+        if (upload_texture == nullptr)
+        {
+            upload_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, render_w * 2, render_h * 2);
+            if (upload_texture == nullptr)
+                return nullptr;
+            SDL_SetTextureScaleMode(upload_texture, SDL_SCALEMODE_NEAREST);
+            SDL_SetTextureBlendMode(upload_texture, SDL_BLENDMODE_NONE);
+        }
+        SDL_Rect lock = { 0, 0, w, h };
+        void* pixels;
+        int bytes;
+        if (!SDL_LockTexture(upload_texture, &lock, &pixels, &bytes))
+            return nullptr;
+        *pitch = bytes / sizeof(Uint32);
+        upload_layer = l;
+        upload_src = { 0, 0, (float)w, (float)h };
+        upload_dst = dst;
+        return (Uint32*)pixels;
+    }
+
+    // Upload the region locked with LockLayerRegion to its layer
+    void UnlockLayerRegion()
+    {
+        if (upload_layer < 0)
+            return;
+        SDL_UnlockTexture(upload_texture);
+        sprite_layer l = (sprite_layer)upload_layer;
+        upload_layer = -1;
+        if (GetLayerTarget(l) == nullptr)
+            return;
+        // Geometry queued before the lock goes underneath
+        FlushLayer(layers[l]);
+        SDL_SetRenderTarget(renderer, layers[l].texture);
+        SDL_RenderTexture(renderer, upload_texture, &upload_src, &upload_dst);
+        screen_updated = true;
+    }
+
+    // Start recording a draw group
+    // Returns true if the group has to be drawn: every draw call until EndDrawGroup is then recorded into the group
+    // (whatever layer it names) at coordinates relative to the group. Returns false if the recording is still valid,
+    // so the draw calls can be skipped. Indexed layer drawing is not recorded
+    // std::string key : Name of the group
+    // int w : Width of the group
+    // int h : Height of the group
+    bool BeginDrawGroup(std::string key, int w, int h)
+    {
+        if (recording_group >= 0 || renderer == NULL || w <= 0 || h <= 0)
+            return false;
+        int index;
+        auto found = draw_group_keys.find(key);
+        if (found != draw_group_keys.end())
+        {
+            index = found->second;
+        }
+        else
+        {
+            // Reuse a deleted slot if there is one
+            index = draw_groups.size();
+            for (int i = 0; i < (int)draw_groups.size(); i++)
+            {
+                if (!draw_groups[i].in_use)
+                {
+                    index = i;
+                    break;
+                }
+            }
+            if (index == (int)draw_groups.size())
+                draw_groups.resize(draw_groups.size() + 1);
+            draw_groups[index] = draw_group();
+            draw_groups[index].in_use = true;
+            draw_groups[index].key = key;
+            draw_group_keys[key] = index;
+        }
+        draw_group& g = draw_groups[index];
+        SDL_Texture* texture = g.target.texture;
+        if (g.valid && texture->w == w && texture->h == h)
+            return false;
+        // Geometry queued earlier this frame may still sample the old recording
+        if (texture != nullptr)
+            FlushBatchesUsing(texture);
+        g.target.cells.clear();
+        // Keep the texture unless the size changed
+        if (texture != nullptr && (texture->w != w || texture->h != h))
+        {
+            SDL_DestroyTexture(texture);
+            texture = nullptr;
+        }
+        if (texture == nullptr)
+        {
+            texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, w, h);
+            g.target.texture = texture;
+        }
+        SDL_SetRenderTarget(renderer, texture);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+        g.target.batch_vertices.clear();
+        g.target.batch_indices.clear();
+        g.target.batch_glyphs.clear();
+        recording_group = index;
+        return true;
+    }
+
+    // Stop recording the current draw group
+    void EndDrawGroup()
+    {
+        if (recording_group < 0)
+            return;
+        draw_group& g = draw_groups[recording_group];
+        FlushLayer(g.target);
+        g.valid = true;
+        recording_group = -1;
+    }
+
+    // Draw a recorded draw group - Costs one quad however many draw calls the group holds
+    // std::string key : Name of the group
+    // double x : Horizontal position of the group
+    // double y : Vertical position of the group
+    // sprite_layer l : Layer to draw the group on
+    void DrawGroup(std::string key, double x, double y, sprite_layer l)
+    {
+        auto found = draw_group_keys.find(key);
+        if (found == draw_group_keys.end() || found->second == recording_group)
+            return;
+        draw_group& g = draw_groups[found->second];
+        if (!g.valid)
+            return;
+        graphic_layer* gl = GetLayerBatch(l, g.target.texture);
+        if (gl == nullptr)
+            return;
+        BatchRect(*gl, { (float)x, (float)y, (float)g.target.texture->w, (float)g.target.texture->h }, { 1, 1, 1, 1 });
+        // Characters recorded into the group go into the layer's character grid too
+        int cw = (g.target.texture->w + font_w - 1) / font_w;
+        for (int i = 0; i < (int)g.target.cells.size(); i++)
+        {
+            if (!g.target.cells[i].set)
+                continue;
+            char_cell* cell = GetCell((int)floor(x / font_w) + i % cw, (int)floor(y / font_h) + i / cw, l);
+            if (cell != nullptr)
+                *cell = g.target.cells[i];
+        }
+        screen_updated = true;
+    }
+
+    // Mark a draw group as out of date so the next BeginDrawGroup records it again
+    // std::string key : Name of the group
+    void InvalidateDrawGroup(std::string key)
+    {
+        auto found = draw_group_keys.find(key);
+        if (found != draw_group_keys.end())
+            draw_groups[found->second].valid = false;
+    }
+
+    // Delete a draw group and free its texture
+    // std::string key : Name of the group
+    void DeleteDrawGroup(std::string key)
+    {
+        auto found = draw_group_keys.find(key);
+        if (found == draw_group_keys.end() || found->second == recording_group)
+            return;
+        draw_group& g = draw_groups[found->second];
+        // Geometry queued on the layers may still sample the texture
+        if (g.target.texture != nullptr)
+            FlushBatchesUsing(g.target.texture);
+        if (g.target.texture != nullptr)
+            SDL_DestroyTexture(g.target.texture);
+        g = draw_group();
+        draw_group_keys.erase(found);
+    }
+
+    // Draw the geometry queued on any layer or draw group that samples a texture, so the texture can be changed
+    // SDL_Texture* texture : Texture about to change
+    void FlushBatchesUsing(SDL_Texture* texture)
+    {
+        for (auto& gl : layers)
+            if (gl.batch_texture == texture)
+                FlushLayer(gl);
+        for (auto& g : draw_groups)
+            if (g.in_use && g.target.batch_texture == texture)
+                FlushLayer(g.target);
+    }
+
+    // Add a scrolling layer backed by a screen-sized ring buffer
+    // The main camera scrolls the layer without wrapping around the world, and moving only shifts where the ring starts.
+    // Only the strips of the world that scroll into view are drawn, by calling on_exposed with:
+    //   sprite_layer l : The layer
+    //   int world_x, int world_y : World position (in drawing units) of the strip
+    //   int x, int y, int w, int h : Rectangle of the layer to draw that world position into (drawing outside it is clipped)
+    // Divide by GetFontW/GetFontH to work in cells. Ring layers follow the main viewport only
+    // int z : Composite order
+    // void (*on_exposed)(sprite_layer, int, int, int, int, int, int) : Function that draws an exposed strip
+    // float parallax_x : Horizontal camera follow factor
+    // float parallax_y : Vertical camera follow factor
+    sprite_layer AddScrollingLayer(int z, void (*on_exposed)(sprite_layer, int, int, int, int, int, int), float parallax_x = 1.f, float parallax_y = 1.f)
+    {
+        sprite_layer l = AddLayer(z, false, parallax_x, parallax_y);
+        graphic_layer& gl = layers[l];
+        gl.ring = true;
+        gl.on_exposed = on_exposed;
+        gl.ring_cam_x = cam_offset_x;
+        gl.ring_cam_y = cam_offset_y;
+        gl.ring_last_x = cam_offset_x;
+        gl.ring_last_y = cam_offset_y;
+        return l;
+    }
+
+    // Have a scrolling layer draw the whole screen again next frame
+    // sprite_layer l : Scrolling layer
+    void InvalidateScrollingLayer(sprite_layer l)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].ring)
+            return;
+        layers[l].ring_valid = false;
+    }
+
+    // Get the world position a scrolling layer shows at the top left of the screen
+    // sprite_layer l : Scrolling layer
+    // int* x : Pointer to store the horizontal world position
+    // int* y : Pointer to store the vertical world position
+    void GetLayerScroll(sprite_layer l, int* x, int* y)
+    {
+        *x = 0;
+        *y = 0;
+        if (l < 0 || l >= (int)layers.size() || !layers[l].ring)
+            return;
+        *x = layers[l].ring_x;
+        *y = layers[l].ring_y;
+    }
+
+    // Remove a layer from the layer stack and free its texture
+    // sprite_layer l : Layer to remove
+    void RemoveLayer(sprite_layer l)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use)
+            return;
+        if (layers[l].texture != nullptr)
+            SDL_DestroyTexture(layers[l].texture);
+        layers[l] = graphic_layer();
+        SortLayers();
+        screen_updated = true;
+    }
+
+    // Set how long a cleared layer can go without being drawn on before its texture is freed
+    // int frames : Frames to wait (0 = keep layer textures until the layer is removed)
+    void SetLayerReleaseFrames(int frames)
+    {
+        layer_release_frames = std::max(frames, 0);
+    }
+
+    // Set the composite order of a layer
+    // sprite_layer l : Layer to change
+    // int z : Composite order (lower z is drawn first)
+    void SetLayerZ(sprite_layer l, int z)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use)
+            return;
+        layers[l].z = z;
+        SortLayers();
+        screen_updated = true;
+    }
+
+    // Set how far a world layer follows the camera
+    // sprite_layer l : Layer to change
+    // float parallax_x : Horizontal camera follow factor
+    // float parallax_y : Vertical camera follow factor
+    void SetLayerParallax(sprite_layer l, float parallax_x, float parallax_y)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use)
+            return;
+        layers[l].parallax_x = parallax_x;
+        layers[l].parallax_y = parallax_y;
+        screen_updated = true;
+    }
+
+    // Set the opacity a layer is composited with
+    // sprite_layer l : Layer to change
+    // float opacity : 0 (invisible) to 1 (opaque)
+    void SetLayerOpacity(sprite_layer l, float opacity)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use)
+            return;
+        layers[l].opacity = std::clamp(opacity, 0.f, 1.f);
+        screen_updated = true;
+    }
+
+    // Set the blend mode a layer is composited with
+    // sprite_layer l : Layer to change
+    // SDL_BlendMode mode : Blend mode (SDL_BLENDMODE_BLEND, SDL_BLENDMODE_ADD, SDL_BLENDMODE_MOD, ...)
+    void SetLayerBlendMode(sprite_layer l, SDL_BlendMode mode)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use)
+            return;
+        layers[l].blend_mode = mode;
+        screen_updated = true;
+    }
+
+    // Show or hide a layer
+    // sprite_layer l : Layer to change
+    // bool visible : Composite the layer
+    void SetLayerVisible(sprite_layer l, bool visible)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use)
+            return;
+        layers[l].visible = visible;
+        screen_updated = true;
+    }
+
+    // Set whether a layer is cleared at the end of every frame
+    // sprite_layer l : Layer to change
+    // bool clear : Clear the layer every frame
+    void SetLayerClearEachFrame(sprite_layer l, bool clear)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use)
+            return;
+        layers[l].clear_each_frame = clear;
+    }
+
+    // Clear everything drawn on a layer
+    // sprite_layer l : Layer to clear
+    void ClearLayer(sprite_layer l)
+    {
+        if (l >= 0 && l < (int)layers.size() && layers[l].indexed)
+        {
+            std::fill(layers[l].indices.begin(), layers[l].indices.end(), 0);
+            layers[l].indexed_dirty = true;
+            screen_updated = true;
+            return;
+        }
+        if (l >= 0 && l < (int)layers.size())
+            std::fill(layers[l].cells.begin(), layers[l].cells.end(), char_cell());
+        if (l < 0 || l >= (int)layers.size() || layers[l].texture == nullptr)
+            return;
+        layers[l].batch_vertices.clear();
+        layers[l].batch_indices.clear();
+        layers[l].batch_glyphs.clear();
+        SDL_SetRenderTarget(renderer, layers[l].texture);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+        screen_updated = true;
+        layers[l].empty = true;
+        layers[l].ring_valid = false;
+        // The retained UI draws itself back
+        if (l == ui_layer)
+            for (int id : ui_draw_order)
+                ui_damage.insert(ui_damage.end(), ui_widgets[id].area);
+    }
+
+    // Start keeping a minimap of the collision layers
+    // The minimap has one pixel per collision cell, colored by collision value (dynamic values cover static ones)
+    void EnableMinimap()
+    {
+        if (minimap_enabled)
+            return;
+        minimap_enabled = true;
+        // Empty cells are transparent and everything else is white until the game picks colors
+        minimap_colors[0] = 0;
+        for (int i = 1; i < 256; i++)
+            minimap_colors[i] = 0xFFFFFFFF;
+        int cells = canvas_w * 2 * canvas_h * 2;
+        minimap_pixels.assign(cells, 0);
+        minimap_cell_dirty.assign(cells, 0);
+        minimap_tile_rects.assign(((canvas_w * 2 + 31) / 32) * ((canvas_h * 2 + 31) / 32), { 0, 0, 0, 0 });
+        for (int i = 0; i < cells; i++)
+            MarkMinimapCellDirty(i);
+    }
+
+    // Set the minimap color of a collision value
+    // int v : Collision value
+    // SDL_Color c : Color cells with this value are shown in
+    void SetMinimapColor(int v, SDL_Color c)
+    {
+        EnableMinimap();
+        minimap_colors[(Uint8)v] = ((Uint32)c.a << 24) | ((Uint32)c.r << 16) | ((Uint32)c.g << 8) | c.b;
+        // Only the cells holding this value change
+        for (int i = 0; i < (int)minimap_pixels.size(); i++)
+            if ((Uint8)collision_static[i / (canvas_w * 2) * col_stride + i % (canvas_w * 2)] == (Uint8)v || (Uint8)collision_dynamic[i / (canvas_w * 2) * col_stride + i % (canvas_w * 2)] == (Uint8)v)
+                MarkMinimapCellDirty(i);
+    }
+
+    // Draw the minimap
+    // double x : Horizontal position of the minimap
+    // double y : Vertical position of the minimap
+    // double w : Width of the minimap
+    // double h : Height of the minimap
+    // sprite_layer l : Layer to draw the minimap on
+    void DrawMinimap(double x, double y, double w, double h, sprite_layer l)
+    {
+        EnableMinimap();
+        if (minimap_texture == nullptr)
+        {
+            minimap_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, canvas_w * 2, canvas_h * 2);
+            if (minimap_texture == nullptr)
+                return;
+            SDL_SetTextureScaleMode(minimap_texture, SDL_SCALEMODE_NEAREST);
+            SDL_SetTextureBlendMode(minimap_texture, SDL_BLENDMODE_BLEND);
+            // A new texture needs every pixel
+            for (int i = 0; i < (int)minimap_pixels.size(); i++)
+                MarkMinimapCellDirty(i);
+        }
+        // Upload the pending changes first so the quad never samples last frame's pixels
+        UpdateMinimap();
+        graphic_layer* gl = GetLayerBatch(l, minimap_texture);
+        if (gl == nullptr)
+            return;
+        BatchRect(*gl, { (float)x, (float)y, (float)w, (float)h }, { 1, 1, 1, 1 });
+        screen_updated = true;
+    }
+
+    // Add a viewport that draws the world from its own camera onto a rectangle of the screen
+    // All viewports share the same layers, so nothing is duplicated or simulated twice
+    // double x : Horizontal position on the screen in drawing units
+    // double y : Vertical position on the screen in drawing units
+    // double w : Width on the screen in drawing units
+    // double h : Height on the screen in drawing units
+    // double cam_x : Horizontal camera offset into the world
+    // double cam_y : Vertical camera offset into the world
+    int AddViewport(double x, double y, double w, double h, double cam_x = 0, double cam_y = 0)
+    {
+        // Reuse a removed slot if there is one (0 is always the main viewport)
+        int index = viewports.size();
+        for (int i = 1; i < (int)viewports.size(); i++)
+        {
+            if (!viewports[i].in_use)
+            {
+                index = i;
+                break;
+            }
+        }
+        if (index == (int)viewports.size())
+            viewports.resize(viewports.size() + 1);
+        viewports[index].in_use = true;
+        viewports[index].rect = { (float)x, (float)y, (float)w, (float)h };
+        viewports[index].cam_x = cam_x;
+        viewports[index].cam_y = cam_y;
+        viewport_revision++;
+        screen_updated = true;
+        return index;
+    }
+
+    // Move a viewport on the screen
+    // Shrink viewport 0 to make room for split-screen views
+    // int id : Viewport index
+    // double x : Horizontal position on the screen in drawing units
+    // double y : Vertical position on the screen in drawing units
+    // double w : Width on the screen in drawing units
+    // double h : Height on the screen in drawing units
+    void SetViewportRect(int id, double x, double y, double w, double h)
+    {
+        if (id < 0 || id >= (int)viewports.size() || !viewports[id].in_use)
+            return;
+        viewports[id].rect = { (float)x, (float)y, (float)w, (float)h };
+        viewport_revision++;
+        screen_updated = true;
+    }
+
+    // Point a viewport's camera into the world
+    // Viewport 0 is the main camera, so this sets cam_offset_x/y
+    // int id : Viewport index
+    // double cam_x : Horizontal camera offset into the world
+    // double cam_y : Vertical camera offset into the world
+    void SetViewportCamera(int id, double cam_x, double cam_y)
+    {
+        if (id == 0)
+        {
+            cam_offset_x = cam_x;
+            cam_offset_y = cam_y;
+            return;
+        }
+        if (id < 0 || id >= (int)viewports.size() || !viewports[id].in_use)
+            return;
+        if (viewports[id].cam_x == (float)cam_x && viewports[id].cam_y == (float)cam_y)
+            return;
+        viewports[id].cam_x = cam_x;
+        viewports[id].cam_y = cam_y;
+        viewport_revision++;
+        screen_updated = true;
+    }
+
+    // Remove a viewport (the main viewport 0 cannot be removed)
+    // int id : Viewport index
+    void RemoveViewport(int id)
+    {
+        if (id <= 0 || id >= (int)viewports.size())
+            return;
+        viewports[id] = viewport();
+        viewport_revision++;
+        screen_updated = true;
+    }
+
+    // Add an 8-bit indexed layer to the layer stack
+    // Pixels hold palette indices and are only expanded to colour for the visible window at composite time,
+    // so changing the palette animates the layer without redrawing it. Index 0 is transparent by default.
+    // Sprites cannot be drawn on indexed layers
+    // int z : Composite order
+    // bool world : Layer scrolls with the camera and wraps around the world (false = fixed to the screen)
+    // float parallax_x : Horizontal camera follow factor
+    // float parallax_y : Vertical camera follow factor
+    sprite_layer AddIndexedLayer(int z, bool world = true, float parallax_x = 1.f, float parallax_y = 1.f)
+    {
+        sprite_layer l = AddLayer(z, world, parallax_x, parallax_y);
+        layers[l].indexed = true;
+        layers[l].palette.assign(256, { 0, 0, 0, 255 });
+        layers[l].palette[0] = { 0, 0, 0, 0 };
+        return l;
+    }
+
+    // Set one palette entry of an indexed layer
+    // sprite_layer l : Indexed layer
+    // Uint8 index : Palette entry
+    // SDL_Color c : Color of the entry
+    void SetPaletteColor(sprite_layer l, Uint8 index, SDL_Color c)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].indexed)
+            return;
+        layers[l].palette[index] = c;
+        layers[l].indexed_dirty = true;
+        screen_updated = true;
+    }
+
+    // Get one palette entry of an indexed layer
+    // sprite_layer l : Indexed layer
+    // Uint8 index : Palette entry
+    SDL_Color GetPaletteColor(sprite_layer l, Uint8 index)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].indexed)
+            return { 0, 0, 0, 0 };
+        return layers[l].palette[index];
+    }
+
+    // Rotate a range of palette entries for colour cycling effects
+    // sprite_layer l : Indexed layer
+    // Uint8 first : First entry of the range
+    // int count : Number of entries in the range
+    // int step : Entries to rotate by (negative rotates the other way)
+    void CyclePalette(sprite_layer l, Uint8 first, int count, int step = 1)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].indexed)
+            return;
+        count = std::min(count, 256 - first);
+        if (count <= 1)
+            return;
+        step = ((step % count) + count) % count;
+        auto begin = layers[l].palette.begin() + first;
+        std::rotate(begin, begin + (count - step), begin + count);
+        layers[l].indexed_dirty = true;
+        screen_updated = true;
+    }
+
+    // Fill a rectangle of an indexed layer with a palette entry
+    // World layers wrap around their edges, screen layers are clipped
+    // double x : Horizontal position of the rectangle
+    // double y : Vertical position of the rectangle
+    // double w : Width of the rectangle
+    // double h : Height of the rectangle
+    // Uint8 index : Palette entry to fill with
+    // sprite_layer l : Indexed layer
+    void DrawRectIndexed(double x, double y, double w, double h, Uint8 index, sprite_layer l)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].indexed || w <= 0 || h <= 0)
+            return;
+        graphic_layer& gl = layers[l];
+        int lw = gl.world ? render_w * 2 : render_w;
+        int lh = gl.world ? render_h * 2 : render_h;
+        if (gl.indices.empty())
+            gl.indices.assign(lw * lh, 0);
+        int x1 = floor(x);
+        int y1 = floor(y);
+        int x2 = floor(x + w);
+        int y2 = floor(y + h);
+        if (!gl.world)
+        {
+            x1 = std::max(x1, 0);
+            y1 = std::max(y1, 0);
+            x2 = std::min(x2, lw);
+            y2 = std::min(y2, lh);
+        }
+        // Never fill more than the whole layer
+        x2 = std::min(x2, x1 + lw);
+        y2 = std::min(y2, y1 + lh);
+        if (x2 <= x1 || y2 <= y1)
+            return;
+        for (int q = y1; q < y2; q++)
+        {
+            Uint8* row = &gl.indices[(((q % lh) + lh) % lh) * lw];
+            // Fill the run up to the right edge, then the wrapped remainder
+            int sx = ((x1 % lw) + lw) % lw;
+            int run = x2 - x1;
+            int first = std::min(run, lw - sx);
+            std::fill(row + sx, row + sx + first, index);
+            std::fill(row, row + (run - first), index);
+        }
+        gl.indexed_dirty = true;
+        screen_updated = true;
+    }
+
+    // Add a light source to the grid lighting
+    // Lights are shadowcast against solid cells of the static collision layer
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // int radius : Reach in collision cells
+    // SDL_Color c : Light color
+    // float intensity : Brightness at the centre
+    int AddLight(double x, double y, int radius, SDL_Color c, float intensity = 1.f)
+    {
+        // Reuse a removed slot if there is one
+        int index = lights.size();
+        for (int i = 0; i < (int)lights.size(); i++)
+        {
+            if (!lights[i].in_use)
+            {
+                index = i;
+                break;
+            }
+        }
+        if (index == (int)lights.size())
+            lights.resize(lights.size() + 1);
+        light_source& ls = lights[index];
+        ls = light_source();
+        ls.in_use = true;
+        ls.x = x;
+        ls.y = y;
+        ls.radius = std::clamp(radius, 0, std::min(canvas_w, canvas_h) - 1);
+        ls.color = c;
+        ls.intensity = intensity;
+        EnableLighting();
+        return index;
+    }
+
+    // Move a light source
+    // The light is only recomputed if it moves into a different cell
+    // int id : Light index
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    void MoveLight(int id, double x, double y)
+    {
+        if (id < 0 || id >= (int)lights.size() || !lights[id].in_use)
+            return;
+        light_source& ls = lights[id];
+        ls.x = x;
+        ls.y = y;
+        if (WrapCellX(floor(x)) != ls.cx || WrapCellY(floor(y)) != ls.cy)
+            ls.dirty = true;
+    }
+
+    // Change the look of a light source
+    // int id : Light index
+    // int radius : Reach in collision cells
+    // SDL_Color c : Light color
+    // float intensity : Brightness at the centre
+    void SetLight(int id, int radius, SDL_Color c, float intensity)
+    {
+        if (id < 0 || id >= (int)lights.size() || !lights[id].in_use)
+            return;
+        light_source& ls = lights[id];
+        ls.radius = std::clamp(radius, 0, std::min(canvas_w, canvas_h) - 1);
+        ls.color = c;
+        ls.intensity = intensity;
+        ls.dirty = true;
+    }
+
+    // Remove a light source
+    // int id : Light index
+    void RemoveLight(int id)
+    {
+        if (id < 0 || id >= (int)lights.size() || !lights[id].in_use)
+            return;
+        // The cells it used to light need to go dark
+        MarkLightBoxDirty(lights[id]);
+        lights[id] = light_source();
+    }
+
+    // Set the light level of cells no light reaches
+    // SDL_Color c : Ambient light color (white leaves the layers unlit)
+    void SetAmbientLight(SDL_Color c)
+    {
+        ambient_light = c;
+        EnableLighting();
+        // Every cell changes
+        for (int i = 0; i < (int)light_cell_dirty.size(); i++)
+            MarkLightCellDirty(i);
+    }
+
+    // Turn the grid lighting on or off
+    // bool enabled : Composite the light map
+    void SetLightingEnabled(bool enabled)
+    {
+        if (enabled)
+            EnableLighting();
+        else
+            lighting_enabled = false;
+        screen_updated = true;
+    }
+
+    // Set whether the light map is blended over a layer (entity and foreground are lit by default)
+    // sprite_layer l : Layer to change
+    // bool lit : Blend the light map over the layer
+    void SetLayerLit(sprite_layer l, bool lit)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use)
+            return;
+        layers[l].lit = lit;
+        screen_updated = true;
+    }
+
+    // Pick where frames are presented. Call this before Start
+    // presentation_backend b : sdl_window (default) or ansi_terminal (character grid written to stdout as ANSI/VT escapes)
+    void SetPresentationBackend(presentation_backend b)
+    {
+        if (!game_running)
+            backend = b;
+    }
+
+    // Draw a character in a cell of a layer's character grid
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    // sprite_layer l : Layer to draw the character on
+    // char glyph : Character to draw
+    void DrawChar(int x, int y, sprite_layer l, char glyph)
+    {
+        char_cell* cell = GetCell(x, y, l);
+        if (cell == nullptr)
+            return;
+        cell->glyph = glyph;
+        cell->set = true;
+        RenderCell(x, y, l);
+    }
+
+    // Set the letter and background color of a cell of a layer's character grid
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    // sprite_layer l : Layer the cell is on
+    // color c : Letter and background color
+    void DrawSetColor(int x, int y, sprite_layer l, color c)
+    {
+        char_cell* cell = GetCell(x, y, l);
+        if (cell == nullptr)
+            return;
+        cell->c = c;
+        cell->set = true;
+        RenderCell(x, y, l);
+    }
+
+    // Draw a string of characters into a row of a layer's character grid
+    // int x : Horizontal cell coordinate of the first character
+    // int y : Vertical cell coordinate
+    // sprite_layer l : Layer to draw the string on
+    // std::string str : Characters to draw
+    // color c : Letter and background color
+    void DrawTextString(int x, int y, sprite_layer l, std::string str, color c)
+    {
+        for (int i = 0; i < (int)str.length(); i++)
+        {
+            char_cell* cell = GetCell(x + i, y, l);
+            if (cell == nullptr)
+                continue;
+            cell->glyph = str[i];
+            cell->c = c;
+            cell->set = true;
+            RenderCell(x + i, y, l);
+        }
+    }
+
+    // Add a widget to the retained UI
+    // The widget is drawn on the UI layer once and then only redrawn when it changes
+    // ui_widget_type type : Kind of widget (panel, label, bar or button)
+    // double x : Horizontal position relative to the parent
+    // double y : Vertical position relative to the parent
+    // double w : Width of the widget
+    // double h : Height of the widget
+    // color c : Text, outline and bar color / background color
+    // int parent : Widget to place this one inside (-1 = root)
+    int AddUIWidget(ui_widget_type type, double x, double y, double w, double h, color c, int parent = -1)
+    {
+        if (parent >= (int)ui_widgets.size() || (parent >= 0 && !ui_widgets[parent].in_use))
+            parent = -1;
+        // Reuse a removed slot if there is one
+        int index = ui_widgets.size();
+        for (int i = 0; i < (int)ui_widgets.size(); i++)
+        {
+            if (!ui_widgets[i].in_use)
+            {
+                index = i;
+                break;
+            }
+        }
+        if (index == (int)ui_widgets.size())
+            ui_widgets.resize(ui_widgets.size() + 1);
+        ui_widget& wg = ui_widgets[index];
+        wg = ui_widget();
+        wg.in_use = true;
+        wg.type = type;
+        wg.parent = parent;
+        wg.rect = { (float)x, (float)y, (float)w, (float)h };
+        wg.c = c;
+        if (parent >= 0)
+        {
+            std::vector<int>& children = ui_widgets[parent].children;
+            children.insert(children.end(), index);
+        }
+        ui_layout_dirty = true;
+        return index;
+    }
+
+    // Remove a widget and all of its children from the retained UI
+    // int id : Widget index
+    void RemoveUIWidget(int id)
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use)
+            return;
+        // Children go first - Copy the list because removing a child edits it
+        std::vector<int> children = ui_widgets[id].children;
+        for (int child : children)
+            RemoveUIWidget(child);
+        ui_widget& wg = ui_widgets[id];
+        if (wg.parent >= 0)
+        {
+            auto& siblings = ui_widgets[wg.parent].children;
+            siblings.erase(std::remove(siblings.begin(), siblings.end(), id), siblings.end());
+        }
+        if (wg.ttf_text != nullptr)
+            TTF_DestroyText(wg.ttf_text);
+        // Whatever was under it shows through again
+        ui_damage.insert(ui_damage.end(), wg.area);
+        wg = ui_widget();
+        ui_layout_dirty = true;
+    }
+
+    // Move or resize a widget (its children move with it)
+    // int id : Widget index
+    // double x : Horizontal position relative to the parent
+    // double y : Vertical position relative to the parent
+    // double w : Width of the widget
+    // double h : Height of the widget
+    void SetUIWidgetRect(int id, double x, double y, double w, double h)
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use)
+            return;
+        SDL_FRect r = { (float)x, (float)y, (float)w, (float)h };
+        if (memcmp(&r, &ui_widgets[id].rect, sizeof(SDL_FRect)) == 0)
+            return;
+        ui_widgets[id].rect = r;
+        ui_layout_dirty = true;
+    }
+
+    // Show or hide a widget and its children
+    // int id : Widget index
+    // bool visible : Draw the widget
+    void SetUIWidgetVisible(int id, bool visible)
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use || ui_widgets[id].visible == visible)
+            return;
+        ui_widgets[id].visible = visible;
+        ui_layout_dirty = true;
+    }
+
+    // Change the colors of a widget
+    // int id : Widget index
+    // color c : Text, outline and bar color / background color
+    void SetUIWidgetColor(int id, color c)
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use)
+            return;
+        ui_widget& wg = ui_widgets[id];
+        if (memcmp(&wg.c, &c, sizeof(color)) == 0)
+            return;
+        wg.c = c;
+        ui_damage.insert(ui_damage.end(), wg.area);
+    }
+
+    // Set the text of a label or button - Setting the same text again costs nothing
+    // int id : Widget index
+    // std::string text : Text to show
+    void SetUIWidgetText(int id, std::string text)
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use)
+            return;
+        ui_widget& wg = ui_widgets[id];
+        if (wg.text == text)
+            return;
+        wg.text = text;
+        if (wg.ttf_text != nullptr)
+            TTF_SetTextString(wg.ttf_text, text.c_str(), text.length());
+        ui_damage.insert(ui_damage.end(), wg.area);
+    }
+
+    // Set the fill of a bar - Setting the same value again costs nothing
+    // int id : Widget index
+    // double value : Current value
+    // double max_value : Value when the bar is full
+    void SetUIWidgetValue(int id, double value, double max_value)
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use)
+            return;
+        ui_widget& wg = ui_widgets[id];
+        if (wg.value == value && wg.max_value == max_value)
+            return;
+        wg.value = value;
+        wg.max_value = max_value;
+        ui_damage.insert(ui_damage.end(), wg.area);
+    }
+
+    // Make the text of a label or button follow a string
+    // The string is compared every frame and the widget is only redrawn when it differs
+    // int id : Widget index
+    // const std::string* text : String to follow (nullptr to stop following)
+    void BindUIWidgetText(int id, const std::string* text)
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use)
+            return;
+        ui_widgets[id].bound_text = text;
+    }
+
+    // Make the fill of a bar follow a number
+    // The number is compared every frame and the widget is only redrawn when it differs
+    // int id : Widget index
+    // const double* value : Number to follow (nullptr to stop following)
+    // double max_value : Value when the bar is full
+    void BindUIWidgetValue(int id, const double* value, double max_value)
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use)
+            return;
+        ui_widgets[id].bound_value = value;
+        SetUIWidgetValue(id, ui_widgets[id].value, max_value);
+    }
+
+    // Set the function a button calls when it is clicked
+    // int id : Widget index
+    // void (*on_click)(int) : Function called with the widget index (nullptr to remove)
+    void SetUIWidgetCallback(int id, void (*on_click)(int))
+    {
+        if (id < 0 || id >= (int)ui_widgets.size() || !ui_widgets[id].in_use)
+            return;
+        ui_widgets[id].on_click = on_click;
+    }
+
+    // Get the top-most visible widget at a point
+    // Returns -1 if there is no widget there (so the game can tell if a click belongs to the world)
+    // double x : Horizontal position in drawing units
+    // double y : Vertical position in drawing units
+    int GetUIWidgetAt(double x, double y)
+    {
+        BuildUILayout();
+        if (x < 0 || y < 0)
+            return -1;
+        int bx = (int)x / ui_bucket_size;
+        int by = (int)y / ui_bucket_size;
+        int cols = (render_w + ui_bucket_size - 1) / ui_bucket_size;
+        if (bx >= cols || by * cols + bx >= (int)ui_buckets.size())
+            return -1;
+        // Buckets are in draw order, so the last hit is the top-most
+        SDL_FPoint p = { (float)x, (float)y };
+        auto& bucket = ui_buckets[by * cols + bx];
+        for (int i = bucket.size() - 1; i >= 0; i--)
+            if (SDL_PointInRectFloat(&p, &ui_widgets[bucket[i]].area))
+                return bucket[i];
+        return -1;
+    }
+
+    // Pick the layer the retained UI is drawn on (the ui layer by default)
+    // sprite_layer l : Screen layer to draw the widgets on
+    void SetUILayer(sprite_layer l)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use || l == ui_layer)
+            return;
+        ClearUIRegions();
+        ui_layer = l;
+        // Everything has to be drawn again on the new layer
+        for (auto& wg : ui_widgets)
+            if (wg.in_use)
+                ui_damage.insert(ui_damage.end(), wg.area);
+    }
+
+    // Register an axis-aligned box with the broadphase so objects can find each other without stamping collision cells
+    // Boxes wrap around the world like everything else on the collision grid
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // double w : Width in collision cells
+    // double h : Height in collision cells
+    // GravityEngine_Object* owner : Object the box belongs to (returned by GetBodyOwner)
+    int AddBody(double x, double y, double w, double h, GravityEngine_Object* owner = nullptr)
+    {
+        if (body_buckets.empty())
+        {
+            body_bucket_cols = (canvas_w * 2 + body_bucket_size - 1) / body_bucket_size;
+            body_bucket_rows = (canvas_h * 2 + body_bucket_size - 1) / body_bucket_size;
+            body_buckets.resize(body_bucket_cols * body_bucket_rows);
+        }
+        // Reuse a removed slot if there is one
+        int index = bodies.size();
+        for (int i = 0; i < (int)bodies.size(); i++)
+        {
+            if (!bodies[i].in_use)
+            {
+                index = i;
+                break;
+            }
+        }
+        if (index == (int)bodies.size())
+            bodies.resize(bodies.size() + 1);
+        bodies[index] = broadphase_body();
+        bodies[index].in_use = true;
+        bodies[index].owner = owner;
+        MoveBody(index, x, y, w, h);
+        return index;
+    }
+
+    // Move or resize a broadphase box
+    // The box is only refiled when it crosses into different buckets
+    // int id : Body index
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // double w : Width in collision cells
+    // double h : Height in collision cells
+    void MoveBody(int id, double x, double y, double w, double h)
+    {
+        if (id < 0 || id >= (int)bodies.size() || !bodies[id].in_use)
+            return;
+        broadphase_body& b = bodies[id];
+        double gw = canvas_w * 2;
+        double gh = canvas_h * 2;
+        b.x = fmod(x, gw);
+        b.y = fmod(y, gh);
+        if (b.x < 0)
+            b.x += gw;
+        if (b.y < 0)
+            b.y += gh;
+        b.w = std::clamp(w, 0.0, gw);
+        b.h = std::clamp(h, 0.0, gh);
+        int bx0 = (int)floor(b.x / body_bucket_size);
+        int by0 = (int)floor(b.y / body_bucket_size);
+        int bx1 = std::min(LastBodyBucket(b.x + b.w, gw, body_bucket_cols), bx0 + body_bucket_cols - 1);
+        int by1 = std::min(LastBodyBucket(b.y + b.h, gh, body_bucket_rows), by0 + body_bucket_rows - 1);
+        if (bx0 == b.bx0 && by0 == b.by0 && bx1 == b.bx1 && by1 == b.by1)
+            return;
+        FileBody(id, false);
+        b.bx0 = bx0;
+        b.by0 = by0;
+        b.bx1 = bx1;
+        b.by1 = by1;
+        FileBody(id, true);
+    }
+
+    // Remove a box from the broadphase
+    // int id : Body index
+    void RemoveBody(int id)
+    {
+        if (id < 0 || id >= (int)bodies.size() || !bodies[id].in_use)
+            return;
+        FileBody(id, false);
+        bodies[id] = broadphase_body();
+    }
+
+    // Get the object a broadphase box belongs to
+    // int id : Body index
+    GravityEngine_Object* GetBodyOwner(int id)
+    {
+        if (id < 0 || id >= (int)bodies.size() || !bodies[id].in_use)
+            return nullptr;
+        return bodies[id].owner;
+    }
+
+    // Find the broadphase boxes that overlap a region
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // double w : Width in collision cells
+    // double h : Height in collision cells
+    // std::vector<int>& out : List the overlapping body indices are added to
+    void QueryRegion(double x, double y, double w, double h, std::vector<int>& out)
+    {
+        QueryBodies(x, y, w, h, -1, out);
+    }
+
+    // Find the broadphase boxes that contain a point
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // std::vector<int>& out : List the body indices are added to
+    void QueryPoint(double x, double y, std::vector<int>& out)
+    {
+        QueryBodies(x, y, 0, 0, -1, out);
+    }
+
+    // Find every pair of overlapping broadphase boxes
+    // Each pair is reported once, with the lower body index first
+    // std::vector<std::pair<int, int>>& out : List the pairs are added to
+    void QueryPairs(std::vector<std::pair<int, int>>& out)
+    {
+        std::vector<int> hits;
+        for (int i = 0; i < (int)bodies.size(); i++)
+        {
+            if (!bodies[i].in_use)
+                continue;
+            hits.clear();
+            QueryBodies(bodies[i].x, bodies[i].y, bodies[i].w, bodies[i].h, i, hits);
+            for (int j : hits)
+                out.insert(out.end(), std::pair<int, int>(i, j));
+        }
+    }
+
+    // Add sounds to the sound list
+    // const char* path : Path to sound file
+    int AddSound(const char* path)
+    {
+        // Initialize all audio channels
+        sounds.insert(sounds.end(), new GravityEngine_Sound(path, global_audio_spec));
+        return sounds.size() - 1;
+    }
+
+    // Delete sound from the sound list
+    // int index : Integer index to where the sound is stored
+    void DeleteSound(int index)
+    {
+        // Delete the sound objects
+        delete[] sounds[index];
+        // Set this index to a nullptr
+        sounds[index] = nullptr;
+    }
+
+    // Play a sound on a channel
+    // int audio_index : Integer index to where the sound is stored
+    // int channel : Integer channel index to play the sound at the index on
+    // bool loop : Whether the sound should loop or not
+    void PlaySoundOnChannel(int audio_index, int channel, bool loop = false)
+    {
+        channel = channel % audio_channels.size();
+        audio_channels[channel]->PlaySound(global_audio_spec, sounds[audio_index], loop);
+    }
+
+    // Bind a synth to a channel
+    // int audio_index : Integer index to where the sound is stored
+    // int channel : Integer channel index to play the sound at the index on
+    // bool loop : Whether the sound should loop or not
+    void BindSynthToChannel(GravityEngine_Synth* s, int channel)
+    {
+        channel = channel % audio_channels.size();
+        audio_channels[channel]->PlaySynth(&global_audio_spec, s);
+    }
+
+    // Pause channel
+    // int channel : Integer channel index
+    void PauseChannel(int channel)
+    {
+        audio_channels[channel]->PausePlayback();
+    }
+
+    // Resume channel
+    // int channel : Integer channel index
+    void ResumeChannel(int channel)
+    {
+        audio_channels[channel]->ResumePlayback();
+    }
+
+    // Stop channel
+    // int channel : Integer channel index
+    void StopChannel(int channel)
+    {
+        audio_channels[channel]->StopPlayback();
+    }
+
+    // Cancel channel's looping status
+    // int channel : Integer channel index
+    void CancelChannelLoop(int channel)
+    {
+        audio_channels[channel]->CancelLoop();
+    }
+
+private:
+
+    // Get the sprite list slot a handle points to. Returns -1 if the slot is empty or holds a later sprite than the handle
+    // int handle : Sprite handle returned by AddSprite
+    int GetSpriteSlot(int handle)
+    {
+        int index = handle & 0xFFFF;
+        if (handle < 0 || index >= (int)sprite_list.size() || sprite_list[index].texture == nullptr || sprite_list[index].generation != handle >> 16)
+            return -1;
+        return index;
+    }
+
+    // Evict unreferenced sprites, least recently used first, until the resident set fits the memory budget
+    void TrimSprites()
+    {
+        while (sprite_memory_budget == 0 || sprite_memory_used > sprite_memory_budget)
+        {
+            // Find the least recently used sprite that nobody holds
+            int lru = -1;
+            for (int i = 0; i < (int)sprite_list.size(); i++)
+                if (sprite_list[i].texture != nullptr && sprite_list[i].ref_count <= 0)
+                    if (lru == -1 || sprite_list[i].last_used < sprite_list[lru].last_used)
+                        lru = i;
+            if (lru == -1)
+                return;
+            // Free the texture and hand the slot back to the free list
+            SDL_DestroyTexture(sprite_list[lru].texture);
+            sprite_memory_used -= sprite_list[lru].bytes;
+            sprite_paths.erase(sprite_list[lru].path);
+            int generation = (sprite_list[lru].generation + 1) & 0x7FFF;
+            sprite_list[lru] = sprite_resource();
+            sprite_list[lru].generation = generation;
+            sprite_free_slots.insert(sprite_free_slots.end(), lru);
+        }
+    }
+
+    // Change the render scale of the world layers
+    // The per-target render scale keeps drawing in logical units, and the persistent layers are resampled into the new scale
+    // float s : New render scale
+    void SetRenderScale(float s)
+    {
+        float old_scale = render_scale;
+        render_scale = s;
+        for (auto& l : layers)
+        {
+            if (!l.in_use || !l.world || l.indexed || l.texture == nullptr)
+                continue;
+            SDL_Texture* layer = l.texture;
+            // Queued geometry is in logical units, so draw it at the old scale first
+            FlushLayer(l);
+            // Resample what is already drawn on the layers that are not cleared every frame
+            if (old_scale != s && !l.clear_each_frame)
+            {
+                SDL_Texture* scratch = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, layer->w, layer->h);
+                SDL_FRect s_rect = { 0, 0, layer->w * old_scale, layer->h * old_scale };
+                SDL_FRect d_rect = { 0, 0, layer->w * s, layer->h * s };
+                SDL_SetRenderTarget(renderer, scratch);
+                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+                SDL_RenderClear(renderer);
+                SDL_SetTextureBlendMode(layer, SDL_BLENDMODE_NONE);
+                SDL_RenderTexture(renderer, layer, &s_rect, &d_rect);
+                SDL_SetRenderTarget(renderer, layer);
+                SDL_SetRenderScale(renderer, 1.f, 1.f);
+                SDL_RenderClear(renderer);
+                SDL_SetTextureBlendMode(scratch, SDL_BLENDMODE_NONE);
+                SDL_RenderTexture(renderer, scratch, NULL, NULL);
+                SDL_DestroyTexture(scratch);
+            }
+            // Every render target keeps its own scale, so later drawing on this layer lands in the scaled area
+            SDL_SetRenderTarget(renderer, layer);
+            SDL_SetRenderScale(renderer, s, s);
+        }
+        SDL_SetRenderTarget(renderer, NULL);
+        screen_updated = true;
+    }
+
+    // Step the render scale towards the compositing budget
+    void UpdateDynamicResolution()
+    {
+        // Smooth out single slow frames
+        composite_time_avg = composite_time_avg * 0.9 + composite_time * 0.1;
+        if (!dynamic_resolution || drs_cooldown-- > 0)
+            return;
+        float s = render_scale;
+        if (composite_time_avg > drs_budget)
+            s = std::max(drs_min_scale, render_scale - drs_step);
+        else if (composite_time_avg < drs_budget * 0.7)
+            s = std::min(drs_max_scale, render_scale + drs_step);
+        if (s != render_scale)
+        {
+            SetRenderScale(s);
+            // Give the average time to settle at the new scale
+            drs_cooldown = 30;
+        }
+    }
+
+    // Get the window rectangle the frame is presented to
+    // Returns NULL (the whole window) unless rendering at a low internal resolution, in which case
+    // the frame is scaled by the largest integer factor that fits and centred
+    const SDL_FRect* GetPresentRect()
+    {
+        if (!low_res)
+            return NULL;
+        // Measure the window, not whatever target happens to be set
+        int out_w, out_h;
+        SDL_GetRenderOutputSize(renderer, &out_w, &out_h);
+        int scale = std::max(1, std::min(out_w / render_w, out_h / render_h));
+        present_rect.w = render_w * scale;
+        present_rect.h = render_h * scale;
+        present_rect.x = (out_w - present_rect.w) / 2;
+        present_rect.y = (out_h - present_rect.h) / 2;
+        return &present_rect;
+    }
+
+    // Wrap a horizontal cell coordinate around the collision grid
+    // int x : Horizontal cell coordinate
+    int WrapCellX(int x)
+    {
+        x %= canvas_w * 2;
+        return x < 0 ? x + canvas_w * 2 : x;
+    }
+
+    // Wrap a vertical cell coordinate around the collision grid
+    // int y : Vertical cell coordinate
+    int WrapCellY(int y)
+    {
+        y %= canvas_h * 2;
+        return y < 0 ? y + canvas_h * 2 : y;
+    }
+
+    // File a broadphase body into or out of every bucket it touches
+    // int id : Body index
+    // bool add : Add the body to the buckets (false = take it out)
+    void FileBody(int id, bool add)
+    {
+        broadphase_body& b = bodies[id];
+        for (int by = b.by0; by <= b.by1; by++)
+        {
+            for (int bx = b.bx0; bx <= b.bx1; bx++)
+            {
+                auto& bucket = body_buckets[(by % body_bucket_rows) * body_bucket_cols + bx % body_bucket_cols];
+                if (add)
+                {
+                    bucket.insert(bucket.end(), id);
+                    continue;
+                }
+                auto found = std::find(bucket.begin(), bucket.end(), id);
+                if (found != bucket.end())
+                {
+                    *found = bucket.back();
+                    bucket.pop_back();
+                }
+            }
+        }
+    }
+
+    // Get the last bucket a span covers on one axis, counted on past the last bucket when the span wraps
+    // The last bucket can be narrower than the others, so a wrapped end is bucketed from the start of the axis again
+    // double end : End of the span (start wrapped into the world plus length)
+    // double size : Length of the axis in cells
+    // int count : Buckets on the axis
+    int LastBodyBucket(double end, double size, int count)
+    {
+        if (end >= size)
+            return count + (int)floor((end - size) / body_bucket_size);
+        return (int)floor(end / body_bucket_size);
+    }
+
+    // Check if two spans overlap on a wrapped axis
+    // double a : Start of the first span
+    // double aw : Length of the first span
+    // double b : Start of the second span
+    // double bw : Length of the second span
+    // double size : Length of the axis
+    bool WrappedOverlap(double a, double aw, double b, double bw, double size)
+    {
+        // On a loop two spans overlap when either one starts inside the other
+        double ab = fmod(b - a, size);
+        double ba = fmod(a - b, size);
+        if (ab < 0)
+            ab += size;
+        if (ba < 0)
+            ba += size;
+        return ab <= aw || ba <= bw;
+    }
+
+    // Collect the broadphase bodies overlapping a box
+    // double x : Horizontal position in collision cells
+    // double y : Vertical position in collision cells
+    // double w : Width in collision cells
+    // double h : Height in collision cells
+    // int after : Only report bodies with a higher index than this
+    // std::vector<int>& out : List the body indices are added to
+    void QueryBodies(double x, double y, double w, double h, int after, std::vector<int>& out)
+    {
+        if (body_buckets.empty())
+            return;
+        double gw = canvas_w * 2;
+        double gh = canvas_h * 2;
+        x = fmod(x, gw);
+        y = fmod(y, gh);
+        if (x < 0)
+            x += gw;
+        if (y < 0)
+            y += gh;
+        w = std::clamp(w, 0.0, gw);
+        h = std::clamp(h, 0.0, gh);
+        body_stamp++;
+        int bx0 = (int)floor(x / body_bucket_size);
+        int by0 = (int)floor(y / body_bucket_size);
+        int bx1 = std::min(LastBodyBucket(x + w, gw, body_bucket_cols), bx0 + body_bucket_cols - 1);
+        int by1 = std::min(LastBodyBucket(y + h, gh, body_bucket_rows), by0 + body_bucket_rows - 1);
+        for (int by = by0; by <= by1; by++)
+        {
+            for (int bx = bx0; bx <= bx1; bx++)
+            {
+                for (int id : body_buckets[(by % body_bucket_rows) * body_bucket_cols + bx % body_bucket_cols])
+                {
+                    broadphase_body& b = bodies[id];
+                    if (id <= after || b.stamp == body_stamp)
+                        continue;
+                    b.stamp = body_stamp;
+                    if (WrappedOverlap(x, w, b.x, b.w, gw) && WrappedOverlap(y, h, b.y, b.h, gh))
+                        out.insert(out.end(), id);
+                }
+            }
+        }
+    }
+
+    // Flag a cell of the minimap for recomputation
+    // int cell : Cell index (y * grid width + x)
+    void MarkMinimapCellDirty(int cell)
+    {
+        if (!minimap_cell_dirty[cell])
+        {
+            minimap_cell_dirty[cell] = 1;
+            minimap_dirty_cells.insert(minimap_dirty_cells.end(), cell);
+        }
+    }
+
+    // Recolor the minimap cells that changed and upload only the rectangles around them
+    void UpdateMinimap()
+    {
+        if (!minimap_enabled || minimap_texture == nullptr || minimap_dirty_cells.empty())
+            return;
+        int grid_w = canvas_w * 2;
+        int grid_h = canvas_h * 2;
+        int tiles_w = (grid_w + 31) / 32;
+        for (int cell : minimap_dirty_cells)
+        {
+            int x = cell % grid_w;
+            int y = cell / grid_w;
+            // Dynamic values cover static ones
+            char v = collision_dynamic[y * col_stride + x] != 0 ? collision_dynamic[y * col_stride + x] : collision_static[y * col_stride + x];
+            minimap_pixels[cell] = minimap_colors[(Uint8)v];
+            minimap_cell_dirty[cell] = 0;
+            // Grow the bounds of the changes in the cell's tile
+            int tile = (y / 32) * tiles_w + x / 32;
+            SDL_Rect& r = minimap_tile_rects[tile];
+            if (r.w == 0)
+            {
+                r = { x, y, 1, 1 };
+                minimap_dirty_tiles.insert(minimap_dirty_tiles.end(), tile);
+                continue;
+            }
+            int x1 = std::max(r.x + r.w, x + 1);
+            int y1 = std::max(r.y + r.h, y + 1);
+            r.x = std::min(r.x, x);
+            r.y = std::min(r.y, y);
+            r.w = x1 - r.x;
+            r.h = y1 - r.y;
+        }
+        // When most of the map changed one upload of the whole texture beats many small ones
+        bool whole = minimap_dirty_cells.size() * 4 > (size_t)(grid_w * grid_h);
+        if (whole)
+            SDL_UpdateTexture(minimap_texture, NULL, minimap_pixels.data(), grid_w * sizeof(Uint32));
+        for (int tile : minimap_dirty_tiles)
+        {
+            SDL_Rect& r = minimap_tile_rects[tile];
+            if (!whole)
+                SDL_UpdateTexture(minimap_texture, &r, &minimap_pixels[r.y * grid_w + r.x], grid_w * sizeof(Uint32));
+            r.w = 0;
+        }
+        minimap_dirty_cells.clear();
+        minimap_dirty_tiles.clear();
+        screen_updated = true;
+    }
+
+    // Allocate the light map buffers the first time lighting is used
+    void EnableLighting()
+    {
+        if (!lighting_enabled && light_cell_dirty.empty())
+        {
+            int cells = canvas_w * 2 * canvas_h * 2;
+            light_accum.assign(cells * 3, 0.f);
+            light_pixels.assign(cells, 0);
+            light_cell_dirty.assign(cells, 0);
+            // Start with every cell dirty so the first update fills the whole map
+            for (int i = 0; i < cells; i++)
+                MarkLightCellDirty(i);
+        }
+        lighting_enabled = true;
+    }
+
+    // Flag a cell of the light map for recomputation
+    // int cell : Cell index (y * grid width + x)
+    void MarkLightCellDirty(int cell)
+    {
+        if (!light_cell_dirty[cell])
+        {
+            light_cell_dirty[cell] = 1;
+            light_dirty_cells.insert(light_dirty_cells.end(), cell);
+        }
+    }
+
+    // Flag every cell a light last contributed to
+    // light_source& ls : Light to flag
+    void MarkLightBoxDirty(light_source& ls)
+    {
+        if (ls.cr < 0)
+            return;
+        for (int y = ls.cy - ls.cr; y <= ls.cy + ls.cr; y++)
+            for (int x = ls.cx - ls.cr; x <= ls.cx + ls.cr; x++)
+                MarkLightCellDirty(WrapCellY(y) * canvas_w * 2 + WrapCellX(x));
+    }
+
+    // Flag the lights whose area contains a cell that changed solidity
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    void InvalidateLightsAt(int x, int y)
+    {
+        for (auto& ls : lights)
+        {
+            if (!ls.in_use || ls.cr < 0)
+                continue;
+            // Shortest wrapped distance to the light's cell
+            int dx = abs(x - ls.cx);
+            int dy = abs(y - ls.cy);
+            dx = std::min(dx, canvas_w * 2 - dx);
+            dy = std::min(dy, canvas_h * 2 - dy);
+            if (dx <= ls.cr && dy <= ls.cr)
+                ls.dirty = true;
+        }
+    }
+
+    // Recursive shadowcasting over one octant of a light (Bjorn Bergstrom's algorithm)
+    // light_source& ls : Light being cast
+    // int row : First row of the octant to scan
+    // float start : Slope the visible arc starts at
+    // float end : Slope the visible arc ends at
+    // int xx, xy, yx, yy : Octant transform
+    void CastLightOctant(light_source& ls, int row, float start, float end, int xx, int xy, int yx, int yy)
+    {
+        if (start < end)
+            return;
+        int side = ls.cr * 2 + 1;
+        float new_start = 0;
+        for (int j = row; j <= ls.cr; j++)
+        {
+            bool blocked = false;
+            for (int dx = -j, dy = -j; dx <= 0; dx++)
+            {
+                float l_slope = (dx - 0.5f) / (dy + 0.5f);
+                float r_slope = (dx + 0.5f) / (dy - 0.5f);
+                if (start < r_slope)
+                    continue;
+                if (end > l_slope)
+                    break;
+                // Offset of this cell from the light
+                int ox = dx * xx + dy * xy;
+                int oy = dx * yx + dy * yy;
+                float dist = sqrt((float)(ox * ox + oy * oy));
+                if (dist <= ls.cr)
+                    ls.contribution[(oy + ls.cr) * side + ox + ls.cr] = ls.intensity * (1.f - dist / (ls.cr + 1));
+                bool solid = collision_static[WrapCellY(ls.cy + oy) * col_stride + WrapCellX(ls.cx + ox)] != 0;
+                if (blocked)
+                {
+                    if (solid)
+                    {
+                        new_start = r_slope;
+                        continue;
+                    }
+                    blocked = false;
+                    start = new_start;
+                }
+                else if (solid && j < ls.cr)
+                {
+                    // Scan the part of the arc before this wall, then carry on after it
+                    blocked = true;
+                    CastLightOctant(ls, j + 1, start, l_slope, xx, xy, yx, yy);
+                    new_start = r_slope;
+                }
+            }
+            if (blocked)
+                break;
+        }
+    }
+
+    // Recompute the brightness a light adds to each cell around it
+    // light_source& ls : Light to recompute
+    void ComputeLight(light_source& ls)
+    {
+        // Old area goes dark, new area gets lit
+        MarkLightBoxDirty(ls);
+        ls.cx = WrapCellX(floor(ls.x));
+        ls.cy = WrapCellY(floor(ls.y));
+        ls.cr = ls.radius;
+        int side = ls.cr * 2 + 1;
+        ls.contribution.assign(side * side, 0.f);
+        ls.contribution[ls.cr * side + ls.cr] = ls.intensity;
+        static const int mult[4][8] = {
+            { 1, 0, 0, -1, -1, 0, 0, 1 },
+            { 0, 1, -1, 0, 0, -1, 1, 0 },
+            { 0, 1, 1, 0, 0, -1, -1, 0 },
+            { 1, 0, 0, 1, -1, 0, 0, -1 } };
+        for (int o = 0; o < 8; o++)
+            CastLightOctant(ls, 1, 1.f, 0.f, mult[0][o], mult[1][o], mult[2][o], mult[3][o]);
+        MarkLightBoxDirty(ls);
+        ls.dirty = false;
+    }
+
+    // Bring the light map up to date, recomputing only around lights and cells that changed
+    void UpdateLighting()
+    {
+        if (!lighting_enabled)
+            return;
+        for (auto& ls : lights)
+            if (ls.in_use && ls.dirty)
+                ComputeLight(ls);
+        if (light_dirty_cells.empty())
+            return;
+
+        int grid_w = canvas_w * 2;
+        // Dirty cells restart from the ambient light
+        for (int cell : light_dirty_cells)
+        {
+            light_accum[cell * 3] = ambient_light.r / 255.f;
+            light_accum[cell * 3 + 1] = ambient_light.g / 255.f;
+            light_accum[cell * 3 + 2] = ambient_light.b / 255.f;
+        }
+        // Flag the 8x8 tiles holding dirty cells, so lights that reach none of them are skipped
+        int tiles_w = (grid_w + 7) / 8;
+        std::vector<char> dirty_tiles(tiles_w * ((canvas_h * 2 + 7) / 8), 0);
+        for (int cell : light_dirty_cells)
+            dirty_tiles[cell / grid_w / 8 * tiles_w + cell % grid_w / 8] = 1;
+        // Add back every light that reaches a dirty cell
+        for (auto& ls : lights)
+        {
+            if (!ls.in_use || ls.cr < 0)
+                continue;
+            // Steps of 8 cells visit every tile the light's box covers, including across the wrap
+            bool reaches = false;
+            for (int y = ls.cy - ls.cr; y <= ls.cy + ls.cr + 7 && !reaches; y += 8)
+                for (int x = ls.cx - ls.cr; x <= ls.cx + ls.cr + 7 && !reaches; x += 8)
+                    reaches = dirty_tiles[WrapCellY(std::min(y, ls.cy + ls.cr)) / 8 * tiles_w + WrapCellX(std::min(x, ls.cx + ls.cr)) / 8];
+            if (!reaches)
+                continue;
+            int side = ls.cr * 2 + 1;
+            float r = ls.color.r / 255.f;
+            float g = ls.color.g / 255.f;
+            float b = ls.color.b / 255.f;
+            for (int oy = 0; oy < side; oy++)
+            {
+                int row = WrapCellY(ls.cy - ls.cr + oy) * grid_w;
+                for (int ox = 0; ox < side; ox++)
+                {
+                    float v = ls.contribution[oy * side + ox];
+                    int cell = row + WrapCellX(ls.cx - ls.cr + ox);
+                    if (v > 0 && light_cell_dirty[cell])
+                    {
+                        light_accum[cell * 3] += r * v;
+                        light_accum[cell * 3 + 1] += g * v;
+                        light_accum[cell * 3 + 2] += b * v;
+                    }
+                }
+            }
+        }
+        // Write the dirty pixels and upload the rows they span in one go
+        int min_row = canvas_h * 2;
+        int max_row = -1;
+        for (int cell : light_dirty_cells)
+        {
+            Uint32 r = (Uint32)(std::min(light_accum[cell * 3], 1.f) * 255);
+            Uint32 g = (Uint32)(std::min(light_accum[cell * 3 + 1], 1.f) * 255);
+            Uint32 b = (Uint32)(std::min(light_accum[cell * 3 + 2], 1.f) * 255);
+            light_pixels[cell] = 0xFF000000 | (r << 16) | (g << 8) | b;
+            light_cell_dirty[cell] = 0;
+            min_row = std::min(min_row, cell / grid_w);
+            max_row = std::max(max_row, cell / grid_w);
+        }
+        light_dirty_cells.clear();
+        if (light_texture == nullptr)
+        {
+            light_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, grid_w, canvas_h * 2);
+            // Nearest keeps one flat value per cell and avoids filtering seams where the map wraps
+            SDL_SetTextureScaleMode(light_texture, SDL_SCALEMODE_NEAREST);
+            SDL_SetTextureBlendMode(light_texture, SDL_BLENDMODE_MOD);
+            min_row = 0;
+            max_row = canvas_h * 2 - 1;
+        }
+        SDL_Rect rows = { 0, min_row, grid_w, max_row - min_row + 1 };
+        SDL_UpdateTexture(light_texture, &rows, &light_pixels[min_row * grid_w], grid_w * sizeof(Uint32));
+        screen_updated = true;
+    }
+
+    // Blend the light map over what has been composited so far in one viewport
+    // int v : Viewport index
+    // SDL_FRect out : Output rectangle the screen maps to
+    void CompositeLightMap(int v, SDL_FRect out)
+    {
+        if (!lighting_enabled || light_texture == nullptr)
+            return;
+        // One texel per collision cell
+        CompositeWorldView(v, light_texture, 1.f / font_w, 1.f / font_h, 1.f, 1.f, out);
+    }
+
+    // Find the palette entry closest to a color
+    // graphic_layer& gl : Indexed layer
+    // SDL_Color c : Color to match
+    Uint8 FindPaletteIndex(graphic_layer& gl, SDL_Color c)
+    {
+        int best = 0;
+        int best_dist = INT_MAX;
+        for (int i = 0; i < 256; i++)
+        {
+            SDL_Color p = gl.palette[i];
+            int dist = (p.r - c.r) * (p.r - c.r) + (p.g - c.g) * (p.g - c.g) + (p.b - c.b) * (p.b - c.b) + (p.a - c.a) * (p.a - c.a);
+            if (dist < best_dist)
+            {
+                best = i;
+                best_dist = dist;
+                if (dist == 0)
+                    break;
+            }
+        }
+        return best;
+    }
+
+    // Expand the visible window of an indexed layer through its palette into the layer's streaming texture
+    // World layers are expanded once per viewport. Nothing is uploaded if the indices, the palette and the cameras are unchanged
+    // graphic_layer& gl : Indexed layer
+    void ExpandIndexedLayer(graphic_layer& gl)
+    {
+        if (!gl.indexed_dirty && (!gl.world || (cam_offset_x == gl.expanded_x && cam_offset_y == gl.expanded_y && viewport_revision == gl.expanded_views)))
+            return;
+        if (gl.texture == nullptr)
+        {
+            gl.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, render_w, render_h);
+            SDL_SetTextureScaleMode(gl.texture, SDL_SCALEMODE_NEAREST);
+        }
+        // Palette as ARGB words
+        Uint32 lut[256];
+        for (int i = 0; i < 256; i++)
+            lut[i] = ((Uint32)gl.palette[i].a << 24) | ((Uint32)gl.palette[i].r << 16) | ((Uint32)gl.palette[i].g << 8) | gl.palette[i].b;
+        int lw = gl.world ? render_w * 2 : render_w;
+        int lh = gl.world ? render_h * 2 : render_h;
+        void* pixels;
+        int pitch;
+        if (!SDL_LockTexture(gl.texture, NULL, &pixels, &pitch))
+            return;
+        // Screen layers and world layers seen through anything but one full screen view need the gaps cleared
+        SDL_FRect screen = { 0, 0, (float)render_w, (float)render_h };
+        int view_count = gl.world ? viewports.size() : 1;
+        bool full = view_count == 1 && SDL_RectsEqualFloat(&viewports[0].rect, &screen);
+        if (gl.world && !full)
+            for (int y = 0; y < render_h; y++)
+                memset((Uint8*)pixels + y * pitch, 0, render_w * sizeof(Uint32));
+        for (int v = 0; v < view_count; v++)
+        {
+            // Screen layers are one view of the layer from the origin
+            SDL_FRect view = screen;
+            float cam_x = 0;
+            float cam_y = 0;
+            if (gl.world)
+            {
+                if (!viewports[v].in_use || !SDL_GetRectIntersectionFloat(&viewports[v].rect, &screen, &view))
+                    continue;
+                GetViewportCamera(v, &cam_x, &cam_y);
+                // The clipped part of the rectangle is a screen offset, so it is added after parallax
+                cam_x = cam_x * gl.parallax_x + view.x - viewports[v].rect.x;
+                cam_y = cam_y * gl.parallax_y + view.y - viewports[v].rect.y;
+            }
+            int vx = view.x;
+            int vy = view.y;
+            int vw = std::min((int)(view.x + view.w), render_w) - vx;
+            int vh = std::min((int)(view.y + view.h), render_h) - vy;
+            int sx = ((int)floor(cam_x) % lw + lw) % lw;
+            int sy = ((int)floor(cam_y) % lh + lh) % lh;
+            for (int y = 0; y < vh; y++)
+            {
+                Uint32* dst = (Uint32*)((Uint8*)pixels + (vy + y) * pitch) + vx;
+                const Uint8* src = &gl.indices[((sy + y) % lh) * lw];
+                // The window crosses the right edge of the layer at most once
+                int first = std::min(vw, lw - sx);
+                for (int x = 0; x < first; x++)
+                    dst[x] = lut[src[sx + x]];
+                for (int x = first; x < vw; x++)
+                    dst[x] = lut[src[x - first]];
+            }
+        }
+        SDL_UnlockTexture(gl.texture);
+        gl.expanded_x = cam_offset_x;
+        gl.expanded_y = cam_offset_y;
+        gl.expanded_views = viewport_revision;
+        gl.indexed_dirty = false;
+    }
+
+    // Convert a color to the float color used by vertices
+    // SDL_Color c : Color to convert
+    SDL_FColor ToFColor(SDL_Color c)
+    {
+        return { c.r / 255.f, c.g / 255.f, c.b / 255.f, c.a / 255.f };
+    }
+
+    // Get a layer ready to queue geometry that samples the given texture
+    // The queued batch is drawn first if it uses a different texture. Returns nullptr if the layer cannot be drawn on
+    // sprite_layer l : Layer to draw on
+    // SDL_Texture* texture : Texture the new geometry samples (nullptr = solid color)
+    graphic_layer* GetLayerBatch(sprite_layer l, SDL_Texture* texture, bool cell = false)
+    {
+        // While a draw group is being recorded everything goes into the group instead of the layer
+        if (recording_group >= 0)
+        {
+            graphic_layer& gg = draw_groups[recording_group].target;
+            if (gg.batch_texture != texture || (!cell && !gg.batch_glyphs.empty()))
+                FlushLayer(gg);
+            gg.batch_texture = texture;
+            return &gg;
+        }
+        // Allocate the layer target on first use
+        if (GetLayerTarget(l) == nullptr)
+            return nullptr;
+        graphic_layer& gl = layers[l];
+        // Anything but another cell has to go over the characters already queued
+        if (gl.batch_texture != texture || (!cell && !gl.batch_glyphs.empty()))
+            FlushLayer(gl);
+        gl.batch_texture = texture;
+        return &gl;
+    }
+
+    // Draw the queued geometry of a layer in one SDL_RenderGeometry call
+    // graphic_layer& gl : Layer to flush
+    void FlushLayer(graphic_layer& gl)
+    {
+        if ((gl.batch_indices.empty() && gl.batch_glyphs.empty()) || gl.texture == nullptr)
+        {
+            gl.batch_vertices.clear();
+            gl.batch_indices.clear();
+            gl.batch_glyphs.clear();
+            return;
+        }
+        SDL_SetRenderTarget(renderer, gl.texture);
+        if (!gl.batch_indices.empty())
+            SDL_RenderGeometry(renderer, gl.batch_texture, gl.batch_vertices.data(), gl.batch_vertices.size(), gl.batch_indices.data(), gl.batch_indices.size());
+        // Characters go over the cell backgrounds queued with them
+        for (auto& g : gl.batch_glyphs)
+        {
+            if (g.cell >= 0 && g.cell < (int)gl.cells.size())
+                gl.cells[g.cell].queued = false;
+            TTF_Text* text = GetGlyphText(g.glyph);
+            if (text == nullptr)
+                continue;
+            TTF_SetTextColor(text, g.c.r, g.c.g, g.c.b, 255);
+            TTF_DrawRendererText(text, g.x, g.y);
+        }
+        gl.batch_vertices.clear();
+        gl.batch_indices.clear();
+        gl.batch_glyphs.clear();
+    }
+
+    // Get the laid out text of one character, creating it the first time it is drawn
+    // char glyph : Character
+    TTF_Text* GetGlyphText(char glyph)
+    {
+        TTF_Text*& text = glyph_texts[(Uint8)glyph];
+        if (text == nullptr && engine != NULL && sans != NULL)
+            text = TTF_CreateText(engine, sans, &glyph, 1);
+        return text;
+    }
+
+    // Queue a vertex and return its index in the batch
+    // graphic_layer& gl : Layer to queue on
+    // SDL_FPoint p : Position
+    // SDL_FColor c : Color
+    // SDL_FPoint uv : Texture coordinate
+    int BatchVertex(graphic_layer& gl, SDL_FPoint p, SDL_FColor c, SDL_FPoint uv = { 0, 0 })
+    {
+        gl.batch_vertices.insert(gl.batch_vertices.end(), { p, c, uv });
+        return gl.batch_vertices.size() - 1;
+    }
+
+    // Queue a triangle from three queued vertices
+    // graphic_layer& gl : Layer to queue on
+    // int a, b, c : Vertex indices
+    void BatchTriangle(graphic_layer& gl, int a, int b, int c)
+    {
+        gl.batch_indices.insert(gl.batch_indices.end(), { a, b, c });
+    }
+
+    // Queue an axis-aligned rectangle, covering the whole batch texture if there is one
+    // graphic_layer& gl : Layer to queue on
+    // SDL_FRect r : Rectangle
+    // SDL_FColor c : Color (tint for textured rectangles)
+    void BatchRect(graphic_layer& gl, SDL_FRect r, SDL_FColor c)
+    {
+        int i = BatchVertex(gl, { r.x, r.y }, c, { 0, 0 });
+        BatchVertex(gl, { r.x + r.w, r.y }, c, { 1, 0 });
+        BatchVertex(gl, { r.x + r.w, r.y + r.h }, c, { 1, 1 });
+        BatchVertex(gl, { r.x, r.y + r.h }, c, { 0, 1 });
+        BatchTriangle(gl, i, i + 1, i + 2);
+        BatchTriangle(gl, i, i + 2, i + 3);
+    }
+
+    // Queue a line as a quad
+    // graphic_layer& gl : Layer to queue on
+    // SDL_FPoint a : Start of the line
+    // SDL_FPoint b : End of the line
+    // double thickness : Width of the line
+    // SDL_FColor c : Color
+    void BatchLine(graphic_layer& gl, SDL_FPoint a, SDL_FPoint b, double thickness, SDL_FColor c)
+    {
+        float dx = b.x - a.x;
+        float dy = b.y - a.y;
+        float len = sqrt(dx * dx + dy * dy);
+        if (len == 0)
+            return;
+        // Half-thickness offset along the line normal
+        float nx = -dy / len * thickness / 2;
+        float ny = dx / len * thickness / 2;
+        int i = BatchVertex(gl, { a.x + nx, a.y + ny }, c);
+        BatchVertex(gl, { b.x + nx, b.y + ny }, c);
+        BatchVertex(gl, { b.x - nx, b.y - ny }, c);
+        BatchVertex(gl, { a.x - nx, a.y - ny }, c);
+        BatchTriangle(gl, i, i + 1, i + 2);
+        BatchTriangle(gl, i, i + 2, i + 3);
+    }
+
+    // Fill the pixels of an indexed layer whose centres fall inside a convex polygon, row by row
+    // const std::vector<SDL_FPoint>& points : Corners of the polygon in order
+    // Uint8 index : Palette entry to fill with
+    // sprite_layer l : Indexed layer
+    void FillConvexIndexed(const std::vector<SDL_FPoint>& points, Uint8 index, sprite_layer l)
+    {
+        float min_y = points[0].y;
+        float max_y = points[0].y;
+        for (auto& p : points)
+        {
+            min_y = std::min(min_y, p.y);
+            max_y = std::max(max_y, p.y);
+        }
+        for (int q = (int)floor(min_y); q < (int)ceil(max_y); q++)
+        {
+            // Where the row's centre line crosses the edges
+            float yc = q + 0.5f;
+            float x0 = INFINITY;
+            float x1 = -INFINITY;
+            for (int i = 0; i < (int)points.size(); i++)
+            {
+                SDL_FPoint a = points[i];
+                SDL_FPoint b = points[(i + 1) % points.size()];
+                if ((yc < a.y) == (yc < b.y))
+                    continue;
+                float cx = a.x + (yc - a.y) * (b.x - a.x) / (b.y - a.y);
+                x0 = std::min(x0, cx);
+                x1 = std::max(x1, cx);
+            }
+            if (x1 < x0)
+                continue;
+            int p0 = (int)ceil(x0 - 0.5f);
+            int p1 = (int)ceil(x1 - 0.5f);
+            DrawRectIndexed(p0, q, p1 - p0, 1, index, l);
+        }
+    }
+
+    // Fill a line of an indexed layer as the same quad BatchLine queues
+    // SDL_FPoint a : Start of the line
+    // SDL_FPoint b : End of the line
+    // double thickness : Width of the line
+    // Uint8 index : Palette entry to fill with
+    // sprite_layer l : Indexed layer
+    void FillLineIndexed(SDL_FPoint a, SDL_FPoint b, double thickness, Uint8 index, sprite_layer l)
+    {
+        float dx = b.x - a.x;
+        float dy = b.y - a.y;
+        float len = sqrt(dx * dx + dy * dy);
+        if (len == 0)
+            return;
+        float nx = -dy / len * thickness / 2;
+        float ny = dx / len * thickness / 2;
+        FillConvexIndexed({ { a.x + nx, a.y + ny }, { b.x + nx, b.y + ny }, { b.x - nx, b.y - ny }, { a.x - nx, a.y - ny } }, index, l);
+    }
+
+    // Get a cell of a layer's character grid, allocating the grid on first use
+    // World layers have a cell per collision cell, screen layers a cell per canvas cell. While a draw group is being
+    // recorded the cell comes from the group's grid instead, relative to the group
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    // sprite_layer l : Layer the cell is on
+    char_cell* GetCell(int x, int y, sprite_layer l)
+    {
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use || layers[l].indexed)
+            return nullptr;
+        graphic_layer& gl = recording_group >= 0 ? draw_groups[recording_group].target : layers[l];
+        int cw = gl.world ? canvas_w * 2 : canvas_w;
+        int ch = gl.world ? canvas_h * 2 : canvas_h;
+        if (recording_group >= 0)
+        {
+            cw = (gl.texture->w + font_w - 1) / font_w;
+            ch = (gl.texture->h + font_h - 1) / font_h;
+        }
+        if (x < 0 || x >= cw || y < 0 || y >= ch)
+            return nullptr;
+        if (gl.cells.empty())
+            gl.cells.resize(cw * ch);
+        screen_updated = true;
+        return &gl.cells[y * cw + x];
+    }
+
+    // Draw a cell of a layer's character grid onto the layer's pixels
+    // The terminal backend reads the grid directly, so this only does work in a window
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    // sprite_layer l : Layer the cell is on
+    void RenderCell(int x, int y, sprite_layer l)
+    {
+        if (backend != sdl_window)
+            return;
+        graphic_layer* gl = GetLayerBatch(l, nullptr, true);
+        char_cell* found = GetCell(x, y, l);
+        if (gl == nullptr || found == nullptr)
+            return;
+        char_cell& cell = *found;
+        // A glyph already queued for the cell would end up over the new background
+        if (cell.queued)
+            FlushLayer(*gl);
+        // The background goes in the batch and the glyph is queued to be drawn over it when the layer is flushed
+        BatchRect(*gl, { (float)(x * font_w), (float)(y * font_h), (float)font_w, (float)font_h }, { cell.c.b.r / 255.f, cell.c.b.g / 255.f, cell.c.b.b / 255.f, 1 });
+        if (cell.glyph == 0 || cell.glyph == ' ')
+            return;
+        gl->batch_glyphs.insert(gl->batch_glyphs.end(), queued_glyph{ (float)(x * font_w), (float)(y * font_h), cell.glyph, cell.c.f, (int)(found - gl->cells.data()) });
+        cell.queued = true;
+    }
+
+    // Get the cell the terminal should show at a screen cell, taking the top-most layer that has something there
+    // int x : Horizontal screen cell coordinate
+    // int y : Vertical screen cell coordinate
+    char_cell ComposeCell(int x, int y)
+    {
+        for (int i = layer_order.size() - 1; i >= 0; i--)
+        {
+            graphic_layer& gl = layers[layer_order[i]];
+            if (!gl.visible || gl.cells.empty())
+                continue;
+            int cx = x;
+            int cy = y;
+            if (gl.world)
+            {
+                // World layers scroll with the main camera in whole cells
+                cx = WrapCellX(x + (int)floor(cam_offset_x * gl.parallax_x / font_w));
+                cy = WrapCellY(y + (int)floor(cam_offset_y * gl.parallax_y / font_h));
+            }
+            char_cell& cell = gl.cells[cy * (gl.world ? canvas_w * 2 : canvas_w) + cx];
+            if (cell.set)
+                return cell;
+        }
+        return char_cell();
+    }
+
+    // Write the character grid to the terminal
+    // Only the cells that changed since the last frame are written, cursor moves are skipped when the next
+    // changed cell follows the last one, and colors are only sent when they change
+    void PresentTerminal()
+    {
+        std::string out;
+        if (!terminal_started)
+        {
+            // Clear the screen and hide the cursor, then paint every cell once
+            out += "\x1b[0m\x1b[2J\x1b[?25l";
+            terminal_cells.assign(canvas_w * canvas_h, char_cell());
+            for (auto& cell : terminal_cells)
+                cell.glyph = -1;
+            terminal_started = true;
+        }
+        int cur_x = -1;
+        int cur_y = -1;
+        bool have_color = false;
+        SDL_Color cur_f = { 0, 0, 0, 0 };
+        SDL_Color cur_b = { 0, 0, 0, 0 };
+        char buf[48];
+        for (int y = 0; y < canvas_h; y++)
+        {
+            for (int x = 0; x < canvas_w; x++)
+            {
+                char_cell cell = ComposeCell(x, y);
+                char glyph = cell.glyph == 0 ? ' ' : cell.glyph;
+                char_cell& shown = terminal_cells[y * canvas_w + x];
+                // Empty cells show as the default colors
+                color c = cell.set ? cell.c : def_color;
+                if (shown.glyph == glyph && memcmp(&shown.c, &c, sizeof(color)) == 0)
+                    continue;
+                shown.glyph = glyph;
+                shown.c = c;
+                // Move the cursor unless it is already here
+                if (cur_x != x || cur_y != y)
+                {
+                    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+                    out += buf;
+                }
+                if (!have_color || memcmp(&cur_f, &c.f, sizeof(SDL_Color)) != 0)
+                {
+                    snprintf(buf, sizeof(buf), "\x1b[38;2;%d;%d;%dm", c.f.r, c.f.g, c.f.b);
+                    out += buf;
+                    cur_f = c.f;
+                }
+                if (!have_color || memcmp(&cur_b, &c.b, sizeof(SDL_Color)) != 0)
+                {
+                    snprintf(buf, sizeof(buf), "\x1b[48;2;%d;%d;%dm", c.b.r, c.b.g, c.b.b);
+                    out += buf;
+                    cur_b = c.b;
+                }
+                have_color = true;
+                out += (glyph >= 32 && glyph < 127) ? glyph : '?';
+                cur_x = x + 1;
+                cur_y = y;
+            }
+        }
+        if (!out.empty())
+        {
+            fwrite(out.data(), 1, out.size(), stdout);
+            fflush(stdout);
+        }
+    }
+
+    // Scroll the ring layers with the main camera and have the game draw the strips that came into view
+    void UpdateScrollingLayers()
+    {
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            graphic_layer& gl = layers[i];
+            if (!gl.in_use || !gl.ring)
+                continue;
+            // cam_offset wraps around the world, so follow it by the shortest step
+            int dx = cam_offset_x - gl.ring_last_x;
+            int dy = cam_offset_y - gl.ring_last_y;
+            if (dx > render_w)
+                dx -= render_w * 2;
+            if (dx < -render_w)
+                dx += render_w * 2;
+            if (dy > render_h)
+                dy -= render_h * 2;
+            if (dy < -render_h)
+                dy += render_h * 2;
+            gl.ring_last_x = cam_offset_x;
+            gl.ring_last_y = cam_offset_y;
+            gl.ring_cam_x += dx;
+            gl.ring_cam_y += dy;
+            int old_x = gl.ring_x;
+            int old_y = gl.ring_y;
+            gl.ring_x = (int)floor(gl.ring_cam_x * gl.parallax_x);
+            gl.ring_y = (int)floor(gl.ring_cam_y * gl.parallax_y);
+            if (GetLayerTarget((sprite_layer)i) == nullptr || gl.on_exposed == nullptr)
+                continue;
+            int nx = gl.ring_x;
+            int ny = gl.ring_y;
+            if (!gl.ring_valid || abs(nx - old_x) >= render_w || abs(ny - old_y) >= render_h)
+            {
+                // Nothing in the ring is usable
+                ExposeRingRect(gl, (sprite_layer)i, nx, ny, render_w, render_h);
+                gl.ring_valid = true;
+                continue;
+            }
+            // Columns that came into view, over the whole height
+            if (nx > old_x)
+                ExposeRingRect(gl, (sprite_layer)i, old_x + render_w, ny, nx - old_x, render_h);
+            else if (nx < old_x)
+                ExposeRingRect(gl, (sprite_layer)i, nx, ny, old_x - nx, render_h);
+            // Rows that came into view, skipping the columns already drawn
+            int kx = std::max(nx, old_x);
+            int kw = std::min(nx, old_x) + render_w - kx;
+            if (ny > old_y)
+                ExposeRingRect(gl, (sprite_layer)i, kx, old_y + render_h, kw, ny - old_y);
+            else if (ny < old_y)
+                ExposeRingRect(gl, (sprite_layer)i, kx, ny, kw, old_y - ny);
+        }
+    }
+
+    // Clear a rectangle of the world in a ring layer and have the game draw it, split where it wraps around the ring
+    // graphic_layer& gl : Ring layer
+    // sprite_layer l : Index of the ring layer
+    // int wx : Horizontal world position
+    // int wy : Vertical world position
+    // int w : Width
+    // int h : Height
+    void ExposeRingRect(graphic_layer& gl, sprite_layer l, int wx, int wy, int w, int h)
+    {
+        if (w <= 0 || h <= 0)
+            return;
+        FlushLayer(gl);
+        SDL_BlendMode old_mode;
+        SDL_GetRenderDrawBlendMode(renderer, &old_mode);
+        int dy = 0;
+        while (dy < h)
+        {
+            int ty = ((wy + dy) % render_h + render_h) % render_h;
+            int ph = std::min(h - dy, render_h - ty);
+            int dx = 0;
+            while (dx < w)
+            {
+                int tx = ((wx + dx) % render_w + render_w) % render_w;
+                int pw = std::min(w - dx, render_w - tx);
+                SDL_Rect clip = { tx, ty, pw, ph };
+                SDL_FRect fclip = { (float)tx, (float)ty, (float)pw, (float)ph };
+                SDL_SetRenderTarget(renderer, gl.texture);
+                SDL_SetRenderClipRect(renderer, &clip);
+                SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+                SDL_RenderFillRect(renderer, &fclip);
+                SDL_SetRenderDrawBlendMode(renderer, old_mode);
+                gl.on_exposed(l, wx + dx, wy + dy, tx, ty, pw, ph);
+                // Draw what the game queued while the clip is still set
+                FlushLayer(gl);
+                SDL_SetRenderTarget(renderer, gl.texture);
+                SDL_SetRenderClipRect(renderer, NULL);
+                dx += pw;
+            }
+            dy += ph;
+        }
+        screen_updated = true;
+    }
+
+    // Count the cells of a collision row span whose value shares a bit with a mask (SSE2 scans 16 cells at a time)
+    // const char* a : Row of one layer (nullptr to skip)
+    // const char* b : Row of the other layer (nullptr to skip)
+    // int x0 : First cell
+    // int x1 : One past the last cell
+    // Uint8 mask : Collision bits to look for
+    // bool stop : Stop at the first matching cell
+    // int* first : Pointer to store the first matching cell in (left alone if there is none, or if it is nullptr)
+    int ScanCollisionSpan(const char* a, const char* b, int x0, int x1, Uint8 mask, bool stop, int* first)
+    {
+        int count = 0;
+        int x = x0;
+#ifdef GRAVITY_SSE2
+        __m128i m = _mm_set1_epi8((char)mask);
+        __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= x1; x += 16)
+        {
+            // Both layers match the same mask, so OR them together first
+            __m128i v = a != nullptr ? _mm_loadu_si128((const __m128i*)(a + x)) : zero;
+            if (b != nullptr)
+                v = _mm_or_si128(v, _mm_loadu_si128((const __m128i*)(b + x)));
+            unsigned bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, m), zero)) & 0xFFFF;
+            if (bits == 0)
+                continue;
+            if (first != nullptr && *first < 0)
+                *first = x + std::countr_zero(bits);
+            if (stop)
+                return count + 1;
+            count += std::popcount(bits);
+        }
+#endif
+        for (; x < x1; x++)
+        {
+            char v = (a != nullptr ? a[x] : 0) | (b != nullptr ? b[x] : 0);
+            if ((v & mask) == 0)
+                continue;
+            if (first != nullptr && *first < 0)
+                *first = x;
+            count++;
+            if (stop)
+                return count;
+        }
+        return count;
+    }
+
+    // Check if a collision cell shares a bit with a mask, wrapping around the world
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    // Uint8 mask : Collision bits to look for
+    // int layers : Layers to look in (query_stat, query_dyn or query_both)
+    bool CellMatches(int x, int y, Uint8 mask, int layers)
+    {
+        int i = WrapCellY(y) * col_stride + WrapCellX(x);
+        char v = ((layers & query_stat) ? collision_static[i] : 0) | ((layers & query_dyn) ? collision_dynamic[i] : 0);
+        return (v & mask) != 0;
+    }
+
+    // Get the first cell a box edge covers on an axis
+    // An edge within rounding of a boundary counts as on it, and a box moving backwards already covers the cell behind
+    // double p : Position of the low edge
+    // double v : Velocity along the axis
+    int SpanLow(double p, double v)
+    {
+        const double eps = 1e-6;
+        return v < 0 ? (int)ceil(p - eps) - 1 : (int)floor(p + eps);
+    }
+
+    // Get the last cell a box edge covers on an axis
+    // An edge within rounding of a boundary counts as on it, and a box moving forwards already covers the cell ahead
+    // double p : Position of the high edge
+    // double v : Velocity along the axis
+    int SpanHigh(double p, double v)
+    {
+        const double eps = 1e-6;
+        return v > 0 ? (int)floor(p + eps) : (int)ceil(p - eps) - 1;
+    }
+
+    // Get the highest pyramid level whose square around a cell has no solid cells (0 if the cell's 2x2 square is not empty)
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    int EmptyOccupancyLevel(int x, int y)
+    {
+        x = WrapCellX(x);
+        y = WrapCellY(y);
+        int level = 0;
+        for (int k = 1; k < (int)occupancy.size(); k++)
+        {
+            if (occupancy[k][(y >> k) * occupancy_w[k] + (x >> k)] != 0)
+                break;
+            level = k;
+        }
+        return level;
+    }
+
+    // Count solid static cells in a rectangle with the occupancy pyramid, stopping once the count reaches a limit
+    // int x : Horizontal coordinate of the rect
+    // int y : Vertical coordinate of the rect
+    // int w : Width of the rect in cells
+    // int h : Height of the rect in cells
+    // int limit : Count to stop at
+    int CountOccupancy(int x, int y, int w, int h, int limit)
+    {
+        EnableOccupancyPyramid();
+        int gw = canvas_w * 2;
+        int gh = canvas_h * 2;
+        if (w <= 0 || h <= 0)
+            return 0;
+        w = std::min(w, gw);
+        h = std::min(h, gh);
+        x = WrapCellX(x);
+        y = WrapCellY(y);
+        // A wrapped rect is at most four rects that do not wrap
+        int count = 0;
+        int xs[2][2] = { { x, std::min(x + w, gw) }, { 0, x + w - gw } };
+        int ys[2][2] = { { y, std::min(y + h, gh) }, { 0, y + h - gh } };
+        for (int j = 0; j < 2; j++)
+            for (int i = 0; i < 2; i++)
+                if (xs[i][1] > xs[i][0] && ys[j][1] > ys[j][0] && count < limit)
+                    CountOccupancySquare((int)occupancy.size() - 1, 0, 0, xs[i][0], ys[j][0], xs[i][1], ys[j][1], limit, &count);
+        return std::min(count, limit);
+    }
+
+    // Add the solid cells of a pyramid square that fall inside a rectangle to a count
+    // int k : Pyramid level
+    // int bx : Horizontal square coordinate at that level
+    // int by : Vertical square coordinate at that level
+    // int x0, int y0, int x1, int y1 : Rectangle (x1, y1 exclusive)
+    // int limit : Count to stop at
+    // int* count : Running count
+    void CountOccupancySquare(int k, int bx, int by, int x0, int y0, int x1, int y1, int limit, int* count)
+    {
+        int n = occupancy[k][by * occupancy_w[k] + bx];
+        if (n == 0 || *count >= limit)
+            return;
+        int sx0 = bx << k;
+        int sy0 = by << k;
+        int sx1 = std::min((bx + 1) << k, canvas_w * 2);
+        int sy1 = std::min((by + 1) << k, canvas_h * 2);
+        if (sx1 <= x0 || sx0 >= x1 || sy1 <= y0 || sy0 >= y1)
+            return;
+        // Squares wholly inside the rect count at once
+        if (sx0 >= x0 && sx1 <= x1 && sy0 >= y0 && sy1 <= y1)
+        {
+            *count += n;
+            return;
+        }
+        for (int c = 0; c < 4; c++)
+        {
+            int cx = bx * 2 + (c & 1);
+            int cy = by * 2 + (c >> 1);
+            if ((cx << (k - 1)) < canvas_w * 2 && (cy << (k - 1)) < canvas_h * 2)
+                CountOccupancySquare(k - 1, cx, cy, x0, y0, x1, y1, limit, count);
+        }
+    }
+
+    // Get the distance from a point to a span on a wrapped axis (0 if the point is inside it)
+    // double p : Point
+    // double a : Start of the span
+    // double b : End of the span
+    // double size : Length of the axis
+    double WrappedGap(double p, double a, double b, double size)
+    {
+        p = fmod(p, size);
+        if (p < 0)
+            p += size;
+        if (p >= a && p < b)
+            return 0;
+        double to_start = fmod(a - p + size, size);
+        double to_end = fmod(p - b + size, size);
+        return std::min(to_start, to_end);
+    }
+
+    // Get the squared distance between two cells on the wrapped grid
+    // int a : Cell index
+    // int b : Cell index
+    int WrappedDistanceSq(int a, int b)
+    {
+        int gw = canvas_w * 2;
+        int gh = canvas_h * 2;
+        int dx = abs(a % gw - b % gw);
+        int dy = abs(a / gw - b / gw);
+        dx = std::min(dx, gw - dx);
+        dy = std::min(dy, gh - dy);
+        return dx * dx + dy * dy;
+    }
+
+    // Repair the distance field around the static cells that changed since the last update
+    // Dynamic brushfire: cells that lost their nearest solid cell are raised (cleared) in a wave, and lowering waves from the
+    // remaining and new solid cells then refill only the area that was affected
+    void UpdateDistanceField()
+    {
+        // Only filled while the field is enabled (or being built)
+        if (distance_changed.empty())
+            return;
+        std::unique_lock<std::shared_mutex> lock(distance_mutex);
+        int gw = canvas_w * 2;
+        const int neighbour_x[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+        const int neighbour_y[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+        std::priority_queue<std::pair<int, int>, std::vector<std::pair<int, int>>, std::greater<std::pair<int, int>>> open;
+        for (int c : distance_changed)
+        {
+            bool solid = collision_static[c / gw * col_stride + c % gw] != 0;
+            if (solid && distance_obst[c] != c)
+            {
+                distance_sq[c] = 0;
+                distance_obst[c] = c;
+                distance_raise[c] = 0;
+                open.push({ 0, c });
+            }
+            else if (!solid && distance_obst[c] == c)
+            {
+                distance_sq[c] = INT_MAX;
+                distance_obst[c] = -1;
+                distance_raise[c] = 1;
+                open.push({ 0, c });
+            }
+        }
+        distance_changed.clear();
+        while (!open.empty())
+        {
+            int c = open.top().second;
+            open.pop();
+            int cx = c % gw;
+            int cy = c / gw;
+            if (distance_raise[c])
+            {
+                // Neighbours that took their distance from a solid cell that is gone are cleared too
+                for (int n = 0; n < 8; n++)
+                {
+                    int nc = WrapCellY(cy + neighbour_y[n]) * gw + WrapCellX(cx + neighbour_x[n]);
+                    int o = distance_obst[nc];
+                    if (o < 0 || distance_raise[nc])
+                        continue;
+                    open.push({ distance_sq[nc], nc });
+                    if (distance_obst[o] != o)
+                    {
+                        distance_sq[nc] = INT_MAX;
+                        distance_obst[nc] = -1;
+                        distance_raise[nc] = 1;
+                    }
+                }
+                distance_raise[c] = 0;
+            }
+            else if (distance_obst[c] >= 0 && distance_obst[distance_obst[c]] == distance_obst[c])
+            {
+                // Offer this cell's solid cell to its neighbours
+                int o = distance_obst[c];
+                for (int n = 0; n < 8; n++)
+                {
+                    int nc = WrapCellY(cy + neighbour_y[n]) * gw + WrapCellX(cx + neighbour_x[n]);
+                    if (distance_raise[nc])
+                        continue;
+                    int d = WrappedDistanceSq(o, nc);
+                    if (d < distance_sq[nc])
+                    {
+                        distance_sq[nc] = d;
+                        distance_obst[nc] = o;
+                        open.push({ d, nc });
+                    }
+                }
+            }
+        }
+    }
+
+    // Reset a path to pending and queue it for the next batch
+    // int id : Path index
+    // int sx : Horizontal cell coordinate of the start
+    // int sy : Vertical cell coordinate of the start
+    // int gx : Horizontal cell coordinate of the goal
+    // int gy : Vertical cell coordinate of the goal
+    // Uint8 mask : Cell values that block the agent
+    void QueuePath(int id, int sx, int sy, int gx, int gy, Uint8 mask)
+    {
+        UnwatchPath(id);
+        path_entry& p = paths[id];
+        p.serial++;
+        p.state = path_pending;
+        p.sx = WrapCellX(sx);
+        p.sy = WrapCellY(sy);
+        p.gx = WrapCellX(gx);
+        p.gy = WrapCellY(gy);
+        p.mask = mask;
+        p.requeues = 0;
+        p.points.clear();
+        p.cells.clear();
+        if (!p.queued)
+            paths_queued.insert(paths_queued.end(), id);
+        p.queued = true;
+    }
+
+    // Stop watching the cells a path crosses
+    // int id : Path index
+    void UnwatchPath(int id)
+    {
+        if (paths[id].state != path_found)
+            return;
+        for (int c : paths[id].cells)
+        {
+            auto it = path_watch.find(c);
+            if (it == path_watch.end())
+                continue;
+            std::vector<int>& ids = it->second;
+            for (int i = 0; i < (int)ids.size(); i++)
+            {
+                if (ids[i] == id)
+                {
+                    ids[i] = ids.back();
+                    ids.pop_back();
+                    break;
+                }
+            }
+            if (ids.empty())
+                path_watch.erase(it);
+        }
+    }
+
+    // Invalidate the solved paths crossing a static cell that starts blocking them
+    // int c : Cell index
+    // int v : New value of the cell
+    void InvalidatePathsAt(int c, int v)
+    {
+        auto it = path_watch.find(c);
+        if (it == path_watch.end())
+            return;
+        std::vector<int> ids = it->second;
+        for (int id : ids)
+        {
+            if (paths[id].state != path_found || (v & paths[id].mask) == 0)
+                continue;
+            UnwatchPath(id);
+            paths[id].state = path_invalid;
+            paths[id].cells.clear();
+            paths[id].points.clear();
+            if (paths[id].on_change != nullptr)
+                paths[id].on_change(id);
+        }
+    }
+
+    // Take solved paths back from the workers and hand them this frame's requests as one batch
+    void UpdatePaths()
+    {
+        int gw = canvas_w * 2;
+        std::vector<path_result> done;
+        if (!path_workers.empty())
+        {
+            std::lock_guard<std::mutex> lock(path_mutex);
+            done.swap(path_results);
+        }
+        for (auto& r : done)
+        {
+            path_entry& p = paths[r.id];
+            if (!p.in_use || p.serial != r.serial || p.state != path_pending)
+                continue;
+            // The static layer may have changed after the copy the path was solved on
+            bool clear = true;
+            if (r.revision != static_revision)
+            {
+                for (int c : r.cells)
+                {
+                    if ((collision_static[c / gw * col_stride + c % gw] & p.mask) != 0)
+                    {
+                        clear = false;
+                        break;
+                    }
+                }
+            }
+            // No route only stands if no cell has been opened since the copy
+            bool stale = !clear || (!r.found && static_opened_revision > r.revision);
+            if (stale && p.requeues < path_max_requeues)
+            {
+                int requeues = p.requeues + 1;
+                QueuePath(r.id, p.sx, p.sy, p.gx, p.gy, p.mask);
+                p.requeues = requeues;
+                continue;
+            }
+            // The layer keeps changing under the path, so give up and let the game ask again
+            if (!clear)
+            {
+                p.state = path_invalid;
+                if (p.on_change != nullptr)
+                    p.on_change(r.id);
+                continue;
+            }
+            p.state = r.found ? path_found : path_blocked;
+            p.points.swap(r.points);
+            p.cells.swap(r.cells);
+            for (int c : p.cells)
+            {
+                std::vector<int>& ids = path_watch[c];
+                ids.insert(ids.end(), r.id);
+            }
+            if (p.on_change != nullptr)
+                p.on_change(r.id);
+        }
+
+        if (paths_queued.empty())
+            return;
+        if (path_workers.empty())
+        {
+            int n = std::clamp((int)std::thread::hardware_concurrency() - 1, 1, 4);
+            for (int i = 0; i < n; i++)
+                path_workers.insert(path_workers.end(), std::thread(&GravityEngine_Core::PathWorker, this));
+        }
+        // Workers search a copy of the static layer so the game can keep changing it
+        std::shared_ptr<const std::vector<char>> grid = GetStaticCopy();
+        {
+            std::lock_guard<std::mutex> lock(path_mutex);
+            for (int id : paths_queued)
+            {
+                path_entry& p = paths[id];
+                p.queued = false;
+                if (p.in_use && p.state == path_pending)
+                    path_jobs.insert(path_jobs.end(), path_job{ id, p.serial, p.sx, p.sy, p.gx, p.gy, p.mask, static_copy_revision, grid });
+            }
+        }
+        paths_queued.clear();
+        path_wake.notify_all();
+    }
+
+    // Get a copy of the static layer (canvas_w * 2 bytes per row) for worker threads, only taken again after the layer changes
+    std::shared_ptr<const std::vector<char>> GetStaticCopy()
+    {
+        if (static_copy_revision != static_revision)
+        {
+            int gw = canvas_w * 2;
+            auto grid = std::make_shared<std::vector<char>>(gw * canvas_h * 2);
+            for (int y = 0; y < canvas_h * 2; y++)
+                memcpy(grid->data() + y * gw, collision_static + y * col_stride, gw);
+            static_copy = grid;
+            static_copy_revision = static_revision;
+        }
+        return static_copy;
+    }
+
+    // Path worker thread - Solves jobs until the engine is destroyed
+    void PathWorker()
+    {
+        path_scratch scratch;
+        while (true)
+        {
+            path_job job;
+            {
+                std::unique_lock<std::mutex> lock(path_mutex);
+                path_wake.wait(lock, [this] { return path_workers_stop || !path_jobs.empty(); });
+                if (path_workers_stop)
+                    return;
+                job = std::move(path_jobs.front());
+                path_jobs.pop_front();
+            }
+            path_result r;
+            r.id = job.id;
+            r.serial = job.serial;
+            r.revision = job.revision;
+            r.found = SolvePath(job, scratch, r.points, r.cells);
+            std::lock_guard<std::mutex> lock(path_mutex);
+            path_results.insert(path_results.end(), std::move(r));
+        }
+    }
+
+    // Check if a cell of a grid copy is open to an agent, wrapping around the world
+    // const char* grid : Static layer copy (canvas_w * 2 bytes per row)
+    // Uint8 mask : Cell values that block the agent
+    // int x : Horizontal cell coordinate
+    // int y : Vertical cell coordinate
+    bool PathOpen(const char* grid, Uint8 mask, int x, int y)
+    {
+        return (grid[WrapCellY(y) * canvas_w * 2 + WrapCellX(x)] & mask) == 0;
+    }
+
+    // Jump from a cell in one direction until a jump point, the goal or a blocking cell is reached
+    // Returns true with the jump point and the number of steps to it if one was found
+    // const char* grid : Static layer copy
+    // Uint8 mask : Cell values that block the agent
+    // int x : Horizontal cell coordinate to jump from
+    // int y : Vertical cell coordinate to jump from
+    // int dx : Horizontal direction (-1, 0 or 1)
+    // int dy : Vertical direction (-1, 0 or 1)
+    // int goal : Cell index of the goal
+    // int& jx : Horizontal cell coordinate of the jump point
+    // int& jy : Vertical cell coordinate of the jump point
+    // int& steps : Steps to the jump point
+    bool JumpPath(const char* grid, Uint8 mask, int x, int y, int dx, int dy, int goal, int& jx, int& jy, int& steps)
+    {
+        int gw = canvas_w * 2;
+        int gh = canvas_h * 2;
+        // A jump never needs to pass its start again, so its length is capped by how soon it would wrap back around
+        int limit = dx == 0 ? gh : dy == 0 ? gw : gw / std::gcd(gw, gh) * gh;
+        for (int n = 1; n < limit; n++)
+        {
+            if (dx != 0 && dy != 0 && !(PathOpen(grid, mask, x + dx, y) && PathOpen(grid, mask, x, y + dy)))
+                return false;
+            x = WrapCellX(x + dx);
+            y = WrapCellY(y + dy);
+            if (!PathOpen(grid, mask, x, y))
+                return false;
+            jx = x;
+            jy = y;
+            steps = n;
+            if (y * gw + x == goal)
+                return true;
+            if (dx != 0 && dy != 0)
+            {
+                // A diagonal stops where a straight jump from it finds something
+                int tx, ty, ts;
+                if (JumpPath(grid, mask, x, y, dx, 0, goal, tx, ty, ts) || JumpPath(grid, mask, x, y, 0, dy, goal, tx, ty, ts))
+                    return true;
+            }
+            else if (dx != 0)
+            {
+                if ((PathOpen(grid, mask, x, y - 1) && !PathOpen(grid, mask, x - dx, y - 1)) ||
+                    (PathOpen(grid, mask, x, y + 1) && !PathOpen(grid, mask, x - dx, y + 1)))
+                    return true;
+            }
+            else
+            {
+                if ((PathOpen(grid, mask, x - 1, y) && !PathOpen(grid, mask, x - 1, y - dy)) ||
+                    (PathOpen(grid, mask, x + 1, y) && !PathOpen(grid, mask, x + 1, y - dy)))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Solve a path request with Jump Point Search on its grid copy. Returns false if the goal cannot be reached
+    // const path_job& job : Request to solve
+    // path_scratch& s : Search state of the calling worker
+    // std::vector<SDL_Point>& points : Vector to fill with the jump points
+    // std::vector<int>& cells : Vector to fill with every cell crossed
+    bool SolvePath(const path_job& job, path_scratch& s, std::vector<SDL_Point>& points, std::vector<int>& cells)
+    {
+        int gw = canvas_w * 2;
+        int gh = canvas_h * 2;
+        const char* grid = job.grid->data();
+        int start = job.sy * gw + job.sx;
+        int goal = job.gy * gw + job.gx;
+        if (!PathOpen(grid, job.mask, job.sx, job.sy) || !PathOpen(grid, job.mask, job.gx, job.gy))
+            return false;
+        if ((int)s.g.size() != gw * gh)
+        {
+            s.g.assign(gw * gh, 0);
+            s.parent.assign(gw * gh, -1);
+            s.dir.assign(gw * gh, 0);
+            s.steps.assign(gw * gh, 0);
+            s.seen.assign(gw * gh, 0);
+            s.closed.assign(gw * gh, 0);
+        }
+        s.search++;
+        // Octile distance to the goal, the short way around the world
+        auto heuristic = [&](int c)
+        {
+            int dx = abs(c % gw - job.gx);
+            int dy = abs(c / gw - job.gy);
+            dx = std::min(dx, gw - dx);
+            dy = std::min(dy, gh - dy);
+            return (float)std::max(dx, dy) + 0.41421356f * std::min(dx, dy);
+        };
+        std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>, std::greater<std::pair<float, int>>> open;
+        s.g[start] = 0;
+        s.parent[start] = -1;
+        s.dir[start] = 4;
+        s.seen[start] = s.search;
+        open.push({ heuristic(start), start });
+        while (!open.empty())
+        {
+            int c = open.top().second;
+            open.pop();
+            if (s.closed[c] == s.search)
+                continue;
+            s.closed[c] = s.search;
+            if (c == goal)
+                break;
+            int x = c % gw;
+            int y = c / gw;
+            // Prune the neighbours to the ones a path through this cell could need
+            int dirs[8][2];
+            int nd = 0;
+            int pdx = s.dir[c] / 3 - 1;
+            int pdy = s.dir[c] % 3 - 1;
+            if (pdx == 0 && pdy == 0)
+            {
+                for (int ddx = -1; ddx <= 1; ddx++)
+                    for (int ddy = -1; ddy <= 1; ddy++)
+                        if ((ddx != 0 || ddy != 0) && PathOpen(grid, job.mask, x + ddx, y + ddy) &&
+                            (ddx == 0 || ddy == 0 || (PathOpen(grid, job.mask, x + ddx, y) && PathOpen(grid, job.mask, x, y + ddy))))
+                        {
+                            dirs[nd][0] = ddx;
+                            dirs[nd++][1] = ddy;
+                        }
+            }
+            else if (pdx != 0 && pdy != 0)
+            {
+                bool open_y = PathOpen(grid, job.mask, x, y + pdy);
+                bool open_x = PathOpen(grid, job.mask, x + pdx, y);
+                if (open_y)
+                {
+                    dirs[nd][0] = 0;
+                    dirs[nd++][1] = pdy;
+                }
+                if (open_x)
+                {
+                    dirs[nd][0] = pdx;
+                    dirs[nd++][1] = 0;
+                }
+                if (open_x && open_y)
+                {
+                    dirs[nd][0] = pdx;
+                    dirs[nd++][1] = pdy;
+                }
+            }
+            else
+            {
+                // Straight moves - (ax, ay) is the direction of travel, (bx, by) is across it
+                int ax = pdx, ay = pdy;
+                int bx = pdy != 0 ? 1 : 0, by = pdx != 0 ? 1 : 0;
+                bool next = PathOpen(grid, job.mask, x + ax, y + ay);
+                bool side_a = PathOpen(grid, job.mask, x + bx, y + by);
+                bool side_b = PathOpen(grid, job.mask, x - bx, y - by);
+                if (next)
+                {
+                    dirs[nd][0] = ax;
+                    dirs[nd++][1] = ay;
+                    if (side_a)
+                    {
+                        dirs[nd][0] = ax + bx;
+                        dirs[nd++][1] = ay + by;
+                    }
+                    if (side_b)
+                    {
+                        dirs[nd][0] = ax - bx;
+                        dirs[nd++][1] = ay - by;
+                    }
+                }
+                if (side_a)
+                {
+                    dirs[nd][0] = bx;
+                    dirs[nd++][1] = by;
+                }
+                if (side_b)
+                {
+                    dirs[nd][0] = -bx;
+                    dirs[nd++][1] = -by;
+                }
+            }
+            for (int i = 0; i < nd; i++)
+            {
+                int jx, jy, steps;
+                if (!JumpPath(grid, job.mask, x, y, dirs[i][0], dirs[i][1], goal, jx, jy, steps))
+                    continue;
+                int j = jy * gw + jx;
+                if (s.closed[j] == s.search)
+                    continue;
+                float ng = s.g[c] + steps * (dirs[i][0] != 0 && dirs[i][1] != 0 ? 1.41421356f : 1.0f);
+                if (s.seen[j] == s.search && ng >= s.g[j])
+                    continue;
+                s.seen[j] = s.search;
+                s.g[j] = ng;
+                s.parent[j] = c;
+                s.dir[j] = (dirs[i][0] + 1) * 3 + dirs[i][1] + 1;
+                s.steps[j] = steps;
+                open.push({ ng + heuristic(j), j });
+            }
+        }
+        if (s.closed[goal] != s.search)
+            return false;
+        // Walk back from the goal, stepping each jump one cell at a time
+        for (int c = goal; c != start; c = s.parent[c])
+        {
+            points.insert(points.end(), SDL_Point{ c % gw, c / gw });
+            int dx = s.dir[c] / 3 - 1;
+            int dy = s.dir[c] % 3 - 1;
+            int x = c % gw;
+            int y = c / gw;
+            for (int n = 0; n < s.steps[c]; n++)
+            {
+                cells.insert(cells.end(), y * gw + x);
+                x = WrapCellX(x - dx);
+                y = WrapCellY(y - dy);
+            }
+        }
+        points.insert(points.end(), SDL_Point{ job.sx, job.sy });
+        cells.insert(cells.end(), start);
+        std::reverse(points.begin(), points.end());
+        std::reverse(cells.begin(), cells.end());
+        return true;
+    }
+
+    // Swap in finished flow field builds, repair the fields around changed static cells and start builds for moved goals
+    void UpdateFlowFields()
+    {
+        for (auto& f : flow_fields)
+        {
+            if (!f.in_use)
+                continue;
+            if (f.build.valid() && f.build.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            {
+                flow_build b = f.build.get();
+                f.cost.swap(b.cost);
+                f.dir.swap(b.dir);
+                f.built_goal = b.goal;
+                // The build searched a copy of the static layer, so catch it up with the cells changed since
+                RepairFlowField(f, f.build_changes);
+                f.build_changes.clear();
+            }
+            if (!flow_changed.empty())
+            {
+                if (!f.cost.empty())
+                    RepairFlowField(f, flow_changed);
+                if (f.build.valid())
+                    f.build_changes.insert(f.build_changes.end(), flow_changed.begin(), flow_changed.end());
+            }
+            if (f.rebuild && !f.build.valid())
+            {
+                f.rebuild = false;
+                std::shared_ptr<const std::vector<char>> grid = GetStaticCopy();
+                Uint8 mask = f.mask;
+                int goal = f.goal;
+                f.build = std::async(std::launch::async, [this, grid, mask, goal]
+                    {
+                        flow_build b;
+                        BuildFlowField(grid->data(), canvas_w * 2, mask, goal, b);
+                        return b;
+                    });
+            }
+        }
+        flow_changed.clear();
+    }
+
+    // Get the neighbour of a cell index, wrapping around the world
+    // int c : Cell index
+    // int dx : Horizontal offset (-1, 0 or 1)
+    // int dy : Vertical offset (-1, 0 or 1)
+    int FlowNeighbour(int c, int dx, int dy)
+    {
+        int gw = canvas_w * 2;
+        return WrapCellY(c / gw + dy) * gw + WrapCellX(c % gw + dx);
     }
 
-    // Handle mouse location
-    // float* ret_x : Pointer to store the horizontal position
-    // float* ret_y : Pointer to store the vertical position
-    void GetMousePosition(float* ret_x, float* ret_y)
+    // Check if an agent can step from a cell to a neighbour without entering or cutting the corner of a blocking cell
+    // const char* grid : Static layer (stride bytes per row)
+    // int stride : Bytes per row of grid
+    // Uint8 mask : Cell values that block the agents
+    // int c : Cell index to step from
+    // int dx : Horizontal step (-1, 0 or 1)
+    // int dy : Vertical step (-1, 0 or 1)
+    bool FlowStep(const char* grid, int stride, Uint8 mask, int c, int dx, int dy)
     {
-        float x, y;
-        SDL_GetMouseState(&x, &y);
+        int gw = canvas_w * 2;
+        auto open = [&](int n) { return (grid[n / gw * stride + n % gw] & mask) == 0; };
+        if (!open(FlowNeighbour(c, dx, dy)))
+            return false;
+        return dx == 0 || dy == 0 || (open(FlowNeighbour(c, dx, 0)) && open(FlowNeighbour(c, 0, dy)));
+    }
 
-        *ret_x = (x / scr_w) * canvas_w;
-        *ret_y = (y / scr_h) * canvas_h;
+    // Build a flow field from scratch with a Dijkstra wavefront. Steps cost 10 or 14, so the open set is kept in 15 rotating
+    // buckets (Dial's algorithm) instead of a heap. Runs on worker threads
+    // const char* grid : Static layer copy (canvas_w * 2 bytes per row)
+    // int stride : Bytes per row of grid
+    // Uint8 mask : Cell values that block the agents
+    // int goal : Cell index of the goal
+    // flow_build& b : Build to fill
+    void BuildFlowField(const char* grid, int stride, Uint8 mask, int goal, flow_build& b)
+    {
+        int gw = canvas_w * 2;
+        int cells = gw * canvas_h * 2;
+        b.goal = goal;
+        b.cost.assign(cells, INT_MAX);
+        b.dir.assign(cells, 4);
+        if ((grid[goal / gw * stride + goal % gw] & mask) != 0)
+            return;
+        std::vector<int> buckets[15];
+        b.cost[goal] = 0;
+        buckets[0].insert(buckets[0].end(), goal);
+        int queued = 1;
+        for (int d = 0; queued > 0; d++)
+        {
+            std::vector<int>& bucket = buckets[d % 15];
+            for (int c : bucket)
+            {
+                if (b.cost[c] != d)
+                    continue;
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    for (int dy = -1; dy <= 1; dy++)
+                    {
+                        if ((dx == 0 && dy == 0) || !FlowStep(grid, stride, mask, c, dx, dy))
+                            continue;
+                        int n = FlowNeighbour(c, dx, dy);
+                        int nd = d + (dx != 0 && dy != 0 ? 14 : 10);
+                        if (nd >= b.cost[n])
+                            continue;
+                        b.cost[n] = nd;
+                        b.dir[n] = (1 - dx) * 3 + 1 - dy;
+                        std::vector<int>& next = buckets[nd % 15];
+                        next.insert(next.end(), n);
+                        queued++;
+                    }
+                }
+            }
+            queued -= bucket.size();
+            bucket.clear();
+        }
     }
 
-    // Get a random number - https://www.geeksforgeeks.org/cpp/how-to-generate-random-number-in-range-in-cpp/
-    // int min : Minimum number to get random value in 
-    // int max : Maximum number to get random value in 
-    int RandRange(int min, int max)
+    // Repair a flow field around static cells that changed
+    // Cells whose way to the goal ran through a cell that now blocks are raised (cleared), then a wavefront from the cells
+    // around them and around cells that opened lowers only the costs that can improve
+    // flow_field& f : Field to repair
+    // const std::vector<int>& changed : Static cells that changed
+    void RepairFlowField(flow_field& f, const std::vector<int>& changed)
     {
-        // Initialize a random number generator
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<> distrib(min, max);
-        // Return value
-        return distrib(gen);
+        if (f.cost.empty() || changed.empty())
+            return;
+        int gw = canvas_w * 2;
+        auto open = [&](int n) { return (collision_static[n / gw * col_stride + n % gw] & f.mask) == 0; };
+        auto next = [&](int n) { return f.dir[n] == 4 ? -1 : FlowNeighbour(n, f.dir[n] / 3 - 1, f.dir[n] % 3 - 1); };
+
+        // Raise every cell whose chain of steps passes through a blocking cell or cuts one of its corners
+        std::vector<int> raised;
+        for (int c : changed)
+        {
+            if (open(c))
+                continue;
+            if (f.cost[c] != INT_MAX)
+            {
+                f.cost[c] = INT_MAX;
+                raised.insert(raised.end(), c);
+            }
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    int n = FlowNeighbour(c, dx, dy);
+                    if (f.cost[n] == INT_MAX || f.dir[n] == 4)
+                        continue;
+                    int ndx = f.dir[n] / 3 - 1;
+                    int ndy = f.dir[n] % 3 - 1;
+                    if (ndx != 0 && ndy != 0 && (FlowNeighbour(n, ndx, 0) == c || FlowNeighbour(n, 0, ndy) == c))
+                    {
+                        f.cost[n] = INT_MAX;
+                        raised.insert(raised.end(), n);
+                    }
+                }
+            }
+        }
+        for (int i = 0; i < (int)raised.size(); i++)
+        {
+            int r = raised[i];
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    int n = FlowNeighbour(r, dx, dy);
+                    if (f.cost[n] != INT_MAX && next(n) == r)
+                    {
+                        f.cost[n] = INT_MAX;
+                        raised.insert(raised.end(), n);
+                    }
+                }
+            }
+            f.dir[r] = 4;
+        }
+
+        // Lower from the cells bordering the raised and opened cells
+        std::priority_queue<std::pair<int, int>, std::vector<std::pair<int, int>>, std::greater<std::pair<int, int>>> wave;
+        if (f.built_goal >= 0 && open(f.built_goal) && f.cost[f.built_goal] != 0)
+        {
+            f.cost[f.built_goal] = 0;
+            f.dir[f.built_goal] = 4;
+            wave.push({ 0, f.built_goal });
+        }
+        auto seed_around = [&](int c)
+        {
+            for (int dx = -1; dx <= 1; dx++)
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    int n = FlowNeighbour(c, dx, dy);
+                    if (f.cost[n] != INT_MAX)
+                        wave.push({ f.cost[n], n });
+                }
+        };
+        for (int r : raised)
+            seed_around(r);
+        for (int c : changed)
+            if (open(c))
+                seed_around(c);
+        while (!wave.empty())
+        {
+            auto [d, c] = wave.top();
+            wave.pop();
+            if (d != f.cost[c])
+                continue;
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    if ((dx == 0 && dy == 0) || !FlowStep(collision_static, col_stride, f.mask, c, dx, dy))
+                        continue;
+                    int n = FlowNeighbour(c, dx, dy);
+                    int nd = d + (dx != 0 && dy != 0 ? 14 : 10);
+                    if (nd >= f.cost[n])
+                        continue;
+                    f.cost[n] = nd;
+                    f.dir[n] = (1 - dx) * 3 + 1 - dy;
+                    wave.push({ nd, n });
+                }
+            }
+        }
     }
 
-    // Add the object to the entity list
-    // GravityEngine_Object* object : Gravity engine managed object reference
-    int AddObject(GravityEngine_Object* object)
+    // Set the bit of a cell in a field of view
+    // fov_map& fov : Map to write
+    // int ox : Horizontal offset from the origin
+    // int oy : Vertical offset from the origin
+    void MarkFOV(fov_map& fov, int ox, int oy)
     {
-        entity_list.insert(entity_list.end(), object);
-        return entity_list.size() - 1;
+        int bx = ox + fov.radius;
+        fov.bits[(oy + fov.radius) * fov.words + bx / 64] |= (Uint64)1 << (bx % 64);
     }
 
-    // Remove the object from the entity list
-    // GravityEngine_Object* object : Gravity engine managed object reference
-    void RemoveObject(GravityEngine_Object* object)
+    // Symmetric shadowcasting over one quadrant of a field of view (Albert Ford's algorithm)
+    // Rows are scanned outward from the origin. A wall seen in a row narrows the arc of the rows behind it, and an open cell is
+    // only marked when its centre lies inside the arc, which is what makes sight symmetric
+    // fov_map& fov : Map to fill
+    // int q : Quadrant (0 = up, 1 = right, 2 = down, 3 = left)
+    // int depth : First row to scan
+    // int start_n : Numerator of the slope the arc starts at
+    // int start_d : Denominator of the slope the arc starts at
+    // int end_n : Numerator of the slope the arc ends at
+    // int end_d : Denominator of the slope the arc ends at
+    // Uint8 mask : Collision bits that block sight
+    // int layers : Layers to look in
+    void CastFOVQuadrant(fov_map& fov, int q, int depth, int start_n, int start_d, int end_n, int end_d, Uint8 mask, int layers)
     {
-        std::erase(entity_list, object);
+        auto floor_div = [](int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); };
+        int r = fov.radius;
+        for (; depth <= r; depth++)
+        {
+            // Cells whose centres round into the arc
+            int min_col = floor_div(2 * depth * start_n + start_d, 2 * start_d);
+            int max_col = -floor_div(end_d - 2 * depth * end_n, 2 * end_d);
+            int prev = -1; // 0 = open, 1 = wall, -1 = no cell yet
+            for (int col = min_col; col <= max_col; col++)
+            {
+                int ox = q == 0 || q == 2 ? col : q == 1 ? depth : -depth;
+                int oy = q == 1 || q == 3 ? col : q == 0 ? -depth : depth;
+                bool wall = CellMatches(fov.origin_x + ox, fov.origin_y + oy, mask, layers);
+                bool centre_inside = col * start_d >= depth * start_n && col * end_d <= depth * end_n;
+                if ((wall || centre_inside) && col * col + depth * depth <= r * r)
+                    MarkFOV(fov, ox, oy);
+                if (prev == 1 && !wall)
+                {
+                    start_n = 2 * col - 1;
+                    start_d = 2 * depth;
+                }
+                if (prev == 0 && wall)
+                    CastFOVQuadrant(fov, q, depth + 1, start_n, start_d, 2 * col - 1, 2 * depth, mask, layers);
+                prev = wall ? 1 : 0;
+            }
+            if (prev != 0)
+                return;
+        }
     }
 
-    // Add the sprite to the sprite list
-    // const char* sprite_path : File path to the sprite to be loaded
-    // SDL_ScaleMode scale_mode : Antialiasing type
-    int AddSprite(const char* sprite_path, SDL_ScaleMode scale_mode = SDL_SCALEMODE_NEAREST)
+    // Remember that part of a dynamic collision row was written this frame
+    // int y : Row
+    // int x0 : First cell written
+    // int x1 : One past the last cell written
+    void MarkDynamicSpan(int y, int x0, int x1)
     {
-        auto sprite = IMG_Load(sprite_path);
-        auto texture = SDL_CreateTextureFromSurface(renderer, sprite);
-        SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
-        SDL_DestroySurface(sprite);
-        sprite_list.insert(sprite_list.end(), texture);
-        return sprite_list.size() - 1;
+        if (dyn_span_min[y] == INT_MAX)
+            dyn_dirty_rows.insert(dyn_dirty_rows.end(), y);
+        dyn_span_min[y] = std::min(dyn_span_min[y], x0);
+        dyn_span_max[y] = std::max(dyn_span_max[y], x1 - 1);
     }
 
-    // Delete sprite from the sprite list
-    // int index : Integer index to where the sprite is stored
-    void DeleteSprite(int index)
+    // Reset the dynamic collision spans written this frame
+    void ClearDynamicSpans()
     {
-        // Delete the texture
-        SDL_DestroyTexture(sprite_list[index]);
-        // Set this index to a nullptr
-        sprite_list[index] = nullptr;
+        for (int y : dyn_dirty_rows)
+        {
+            int x0 = dyn_span_min[y];
+            int x1 = dyn_span_max[y] + 1;
+            char* row = collision_dynamic + y * col_stride;
+            // The minimap only needs the cells that were set
+            if (minimap_enabled)
+                for (int x = x0; x < x1; x++)
+                    if (row[x] != 0)
+                        MarkMinimapCellDirty(y * canvas_w * 2 + x);
+            memset(row + x0, 0, x1 - x0);
+            if (collision_bits_enabled)
+                std::fill(solid_bits_dynamic.begin() + y * col_words + x0 / 64, solid_bits_dynamic.begin() + y * col_words + (x1 - 1) / 64 + 1, 0);
+            dyn_span_min[y] = INT_MAX;
+            dyn_span_max[y] = -1;
+        }
+        dyn_dirty_rows.clear();
     }
 
-    // Draw a sprite at a location
-    // int index : Integer index to where the sprite is stored
-    // double x : Horizontal position of sprite
-    // double y : Vertical position of sprite
-    // double w_scale : Horizontal scaling of sprite
-    // double H_scale : Vertical scaling of sprite
-    // sprite_layer l : Layer to draw the sprite on
-    void DrawSprite(int index, double x, double y, double w_scale, double h_scale, sprite_layer l)
-    {
-        SDL_Texture* rt = p_entity_texture;
-        // Set the target layer
-        switch (l)
-        {
-        case background:
-            rt = p_background_texture;
-            break;
-        case entity:
-            rt = p_entity_texture;
-            break;
-        case foreground:
-            rt = p_foreground_texture;
-            break;
-        case ui:
-            rt = p_ui_texture;
-            break;
-        case debug:
-            rt = p_debug_texture;
-            break;
-        }
-        SDL_SetRenderTarget(renderer, rt);
-        // Get the dimensions of the character
-        float w, h;
-        SDL_GetTextureSize(sprite_list[index], &w, &h);
-        // Create an FRect to draw to
-        SDL_FRect dst = { x, y, w * w_scale, h * w_scale };
-        // Render the sprite to the graphical layer
-        SDL_RenderTexture(renderer, sprite_list[index], NULL, &dst);
-        // Re-render if wrap
-        if (x + w * w_scale > scr_w * 2)
+    // Rebuild the draw order, screen rectangles and hit-test buckets of the retained UI if the tree changed
+    void BuildUILayout()
+    {
+        if (!ui_layout_dirty)
+            return;
+        ui_layout_dirty = false;
+        // Anything that was visible may move or disappear
+        for (int id : ui_draw_order)
+            ui_damage.insert(ui_damage.end(), ui_widgets[id].area);
+        ui_draw_order.clear();
+        for (int i = 0; i < (int)ui_widgets.size(); i++)
+            if (ui_widgets[i].in_use && ui_widgets[i].parent == -1)
+                AddUIToDrawOrder(i, 0, 0);
+        // Put the visible widgets in every bucket they touch
+        int cols = (render_w + ui_bucket_size - 1) / ui_bucket_size;
+        int rows = (render_h + ui_bucket_size - 1) / ui_bucket_size;
+        ui_buckets.assign(cols * rows, std::vector<int>());
+        for (int id : ui_draw_order)
         {
-            // Create an FRect to draw to
-            SDL_FRect dst_w = { x - scr_w * 2, y, w * w_scale, h * w_scale };
-            // Render the sprite to the graphical layer
-            SDL_RenderTexture(renderer, sprite_list[index], NULL, &dst_w);
+            ui_widget& wg = ui_widgets[id];
+            ui_damage.insert(ui_damage.end(), wg.area);
+            if (wg.area.w <= 0 || wg.area.h <= 0)
+                continue;
+            int x0 = std::max(0, (int)floor(wg.area.x / ui_bucket_size));
+            int y0 = std::max(0, (int)floor(wg.area.y / ui_bucket_size));
+            int x1 = std::min(cols - 1, (int)floor((wg.area.x + wg.area.w) / ui_bucket_size));
+            int y1 = std::min(rows - 1, (int)floor((wg.area.y + wg.area.h) / ui_bucket_size));
+            for (int by = y0; by <= y1; by++)
+                for (int bx = x0; bx <= x1; bx++)
+                {
+                    std::vector<int>& bucket = ui_buckets[by * cols + bx];
+                    bucket.insert(bucket.end(), id);
+                }
         }
-        if (y + h * h_scale > scr_h * 2)
+    }
+
+    // Add a visible widget and its children to the draw order, resolving their screen rectangles
+    // int id : Widget index
+    // float x : Screen position of the parent
+    // float y : Screen position of the parent
+    void AddUIToDrawOrder(int id, float x, float y)
+    {
+        ui_widget& wg = ui_widgets[id];
+        wg.area = { x + wg.rect.x, y + wg.rect.y, wg.rect.w, wg.rect.h };
+        if (!wg.visible)
         {
-            // Create an FRect to draw to
-            SDL_FRect dst_w = { x, y - scr_h * 2, w * w_scale, h * w_scale };
-            // Render the sprite to the graphical layer
-            SDL_RenderTexture(renderer, sprite_list[index], NULL, &dst_w);
+            wg.area = { 0, 0, 0, 0 };
+            return;
         }
-        if (y + h * h_scale > scr_h * 2 && x + w * w_scale > scr_w * 2)
+        ui_draw_order.insert(ui_draw_order.end(), id);
+        for (int child : wg.children)
+            AddUIToDrawOrder(child, wg.area.x, wg.area.y);
+    }
+
+    // Clear every widget region from the UI layer
+    void ClearUIRegions()
+    {
+        graphic_layer* gl = GetLayerBatch(ui_layer, nullptr);
+        if (gl == nullptr)
+            return;
+        FlushLayer(*gl);
+        SDL_SetRenderTarget(renderer, gl->texture);
+        SDL_BlendMode old_mode;
+        SDL_GetRenderDrawBlendMode(renderer, &old_mode);
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        for (int id : ui_draw_order)
+            SDL_RenderFillRect(renderer, &ui_widgets[id].area);
+        SDL_SetRenderDrawBlendMode(renderer, old_mode);
+        screen_updated = true;
+    }
+
+    // Draw one widget on the UI layer
+    // graphic_layer& gl : UI layer
+    // ui_widget& wg : Widget to draw
+    void RenderUIWidget(graphic_layer& gl, ui_widget& wg)
+    {
+        SDL_FRect a = wg.area;
+        SDL_Color back = wg.c.b;
+        // Buttons light up under the mouse and darken while held
+        if (wg.type == ui_button && wg.pressed)
+            back = { (Uint8)(back.r * 3 / 4), (Uint8)(back.g * 3 / 4), (Uint8)(back.b * 3 / 4), back.a };
+        else if (wg.type == ui_button && wg.hovered)
+            back = { (Uint8)(back.r + (255 - back.r) / 4), (Uint8)(back.g + (255 - back.g) / 4), (Uint8)(back.b + (255 - back.b) / 4), back.a };
+        if (back.a > 0)
+            BatchRect(gl, a, ToFColor(back));
+        if (wg.type == ui_bar && wg.max_value > 0)
         {
-            // Create an FRect to draw to
-            SDL_FRect dst_w = { x - scr_w * 2, y - scr_h * 2, w * w_scale, h * w_scale };
-            // Render the sprite to the graphical layer
-            SDL_RenderTexture(renderer, sprite_list[index], NULL, &dst_w);
+            SDL_FRect fill = a;
+            fill.w = a.w * std::clamp(wg.value / wg.max_value, 0.0, 1.0);
+            BatchRect(gl, fill, ToFColor(wg.c.f));
         }
-        if (x < 0 && y < 0)
+        if (wg.type == ui_panel || wg.type == ui_button)
         {
-            // Create an FRect to draw to
-            SDL_FRect dst_w = { x + scr_w * 2, y + scr_h * 2, w * w_scale, h * w_scale };
-            // Render the sprite to the graphical layer
-            SDL_RenderTexture(renderer, sprite_list[index], NULL, &dst_w);
+            SDL_FColor o = ToFColor(wg.c.f);
+            BatchRect(gl, { a.x, a.y, a.w, 1 }, o);
+            BatchRect(gl, { a.x, a.y + a.h - 1, a.w, 1 }, o);
+            BatchRect(gl, { a.x, a.y + 1, 1, a.h - 2 }, o);
+            BatchRect(gl, { a.x + a.w - 1, a.y + 1, 1, a.h - 2 }, o);
         }
-        if (x < 0)
+        if ((wg.type != ui_label && wg.type != ui_button) || wg.text.empty() || engine == NULL || sans == NULL)
+            return;
+        if (wg.ttf_text == nullptr)
+            wg.ttf_text = TTF_CreateText(engine, sans, wg.text.c_str(), wg.text.length());
+        // Text is drawn by SDL_ttf, so the queued rectangles go first
+        FlushLayer(gl);
+        SDL_SetRenderTarget(renderer, gl.texture);
+        int tw, th;
+        TTF_GetTextSize(wg.ttf_text, &tw, &th);
+        TTF_SetTextColor(wg.ttf_text, wg.c.f.r, wg.c.f.g, wg.c.f.b, wg.c.f.a);
+        // Labels are left aligned, buttons are centred
+        float tx = wg.type == ui_button ? a.x + (a.w - tw) / 2 : a.x;
+        TTF_DrawRendererText(wg.ttf_text, floor(tx), floor(a.y + (a.h - th) / 2));
+    }
+
+    // Bring the retained UI up to date
+    // Follows bound values, handles button hover and clicks, then redraws only the damaged regions of the UI layer
+    void UpdateUI()
+    {
+        if (ui_widgets.empty())
+            return;
+        BuildUILayout();
+
+        // Follow the bound values - Unchanged values cost a compare
+        for (int id : ui_draw_order)
         {
-            // Create an FRect to draw to
-            SDL_FRect dst_w = { x + scr_w * 2, y, w * w_scale, h * w_scale };
-            // Render the sprite to the graphical layer
-            SDL_RenderTexture(renderer, sprite_list[index], NULL, &dst_w);
+            ui_widget& wg = ui_widgets[id];
+            if (wg.bound_text != nullptr && *wg.bound_text != wg.text)
+                SetUIWidgetText(id, *wg.bound_text);
+            if (wg.bound_value != nullptr && *wg.bound_value != wg.value)
+                SetUIWidgetValue(id, *wg.bound_value, wg.max_value);
         }
-        if (y < 0)
+
+        // Hit test the mouse against the buckets
+        if (renderer != NULL)
         {
-            // Create an FRect to draw to
-            SDL_FRect dst_w = { x, y + scr_h * 2, w * w_scale, h * w_scale };
-            // Render the sprite to the graphical layer
-            SDL_RenderTexture(renderer, sprite_list[index], NULL, &dst_w);
+            float mx, my;
+            GetMousePosition(&mx, &my);
+            int hit = GetUIWidgetAt(mx * font_w, my * font_h);
+            bool down = GetMouseButtonState(SDL_BUTTON_LEFT);
+            int clicked = -1;
+            for (int id : ui_draw_order)
+            {
+                ui_widget& wg = ui_widgets[id];
+                if (wg.type != ui_button)
+                    continue;
+                bool hovered = id == hit;
+                bool pressed = wg.pressed;
+                if (hovered && down && !ui_mouse_down)
+                    pressed = true;
+                if (!down)
+                {
+                    // A click is a press and a release on the same button
+                    if (pressed && hovered)
+                        clicked = id;
+                    pressed = false;
+                }
+                if (hovered != wg.hovered || pressed != wg.pressed)
+                    ui_damage.insert(ui_damage.end(), wg.area);
+                wg.hovered = hovered;
+                wg.pressed = pressed;
+            }
+            ui_mouse_down = down;
+            if (clicked >= 0 && ui_widgets[clicked].on_click != nullptr)
+                ui_widgets[clicked].on_click(clicked);
+            // The callback may have changed the tree
+            BuildUILayout();
         }
-        // Notofy the drawing pipeline that a change has been made
+
+        if (ui_damage.empty())
+            return;
+        graphic_layer* gl = GetLayerBatch(ui_layer, nullptr);
+        if (gl == nullptr)
+        {
+            ui_damage.clear();
+            return;
+        }
+        // Lots of small changes are cheaper to redraw as one region
+        if (ui_damage.size() > 8)
+        {
+            SDL_FRect all = ui_damage[0];
+            for (auto& r : ui_damage)
+                SDL_GetRectUnionFloat(&all, &r, &all);
+            ui_damage.assign(1, all);
+        }
+        FlushLayer(*gl);
+        SDL_BlendMode old_mode;
+        SDL_GetRenderDrawBlendMode(renderer, &old_mode);
+        for (auto& r : ui_damage)
+        {
+            if (r.w <= 0 || r.h <= 0)
+                continue;
+            SDL_Rect clip = { (int)floor(r.x), (int)floor(r.y), (int)ceil(r.x + r.w) - (int)floor(r.x), (int)ceil(r.y + r.h) - (int)floor(r.y) };
+            SDL_FRect fclip = { (float)clip.x, (float)clip.y, (float)clip.w, (float)clip.h };
+            // Clear the region, then draw every widget that touches it in order, clipped to the region
+            SDL_SetRenderTarget(renderer, gl->texture);
+            SDL_SetRenderClipRect(renderer, &clip);
+            SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+            SDL_RenderFillRect(renderer, &fclip);
+            SDL_SetRenderDrawBlendMode(renderer, old_mode);
+            for (int id : ui_draw_order)
+                if (SDL_HasRectIntersectionFloat(&ui_widgets[id].area, &fclip))
+                    RenderUIWidget(*gl, ui_widgets[id]);
+            FlushLayer(*gl);
+            SDL_SetRenderTarget(renderer, gl->texture);
+            SDL_SetRenderClipRect(renderer, NULL);
+        }
+        ui_damage.clear();
         screen_updated = true;
     }
 
-    // Draw a rectangle
-    void DrawRect(double x, double y, double w, double h, SDL_Color c, sprite_layer l)
+    // Initialise a slot in the layer stack
+    // sprite_layer l : Layer slot
+    // int z : Composite order
+    // bool world : Layer scrolls with the camera and wraps
+    // bool clear_each_frame : Layer is cleared at the end of every frame
+    void SetupLayer(sprite_layer l, int z, bool world, bool clear_each_frame)
     {
-        SDL_Texture* rt = p_entity_texture;
-        // Set the target layer
-        switch (l)
-        {
-        case background:
-            rt = p_background_texture;
-            break;
-        case entity:
-            rt = p_entity_texture;
-            break;
-        case foreground:
-            rt = p_foreground_texture;
-            break;
-        case ui:
-            rt = p_ui_texture;
-            break;
-        case debug:
-            rt = p_debug_texture;
-            break;
-        }
-        SDL_SetRenderTarget(renderer, rt);
-        // Create an FRect to draw to
-        SDL_FRect fr = { x, y, w, h };
-        // Fill the rectangle with color
-        SDL_SetRenderDrawColor(renderer,
-            c.r,
-            c.g,
-            c.b,
-            c.a);
-        SDL_RenderFillRect(renderer, &fr);
-        // Render the rectangle
-        SDL_RenderRect(renderer, &fr);
-        // Notify the drawing pipeline that a change has been made
-        screen_updated = true;
+        graphic_layer& gl = layers[l];
+        gl = graphic_layer();
+        gl.in_use = true;
+        gl.z = z;
+        gl.world = world;
+        gl.clear_each_frame = clear_each_frame;
+        SortLayers();
     }
 
-    // Add sounds to the sound list
-    // const char* path : Path to sound file
-    int AddSound(const char* path)
+    // Rebuild the composite order from the layer z values
+    void SortLayers()
     {
-        // Initialize all audio channels
-        sounds.insert(sounds.end(), new GravityEngine_Sound(path, global_audio_spec));
-        return sounds.size() - 1;
+        layer_order.clear();
+        for (int i = 0; i < (int)layers.size(); i++)
+            if (layers[i].in_use)
+                layer_order.insert(layer_order.end(), i);
+        std::stable_sort(layer_order.begin(), layer_order.end(), [this](int a, int b) { return layers[a].z < layers[b].z; });
     }
 
-    // Delete sound from the sound list
-    // int index : Integer index to where the sound is stored
-    void DeleteSound(int index)
+    // Make a layer the current render target, allocating its texture on first use
+    // Returns the layer texture, or nullptr if the layer does not exist
+    // sprite_layer l : Layer to draw on
+    SDL_Texture* GetLayerTarget(sprite_layer l)
     {
-        // Delete the sound objects
-        delete[] sounds[index];
-        // Set this index to a nullptr
-        sounds[index] = nullptr;
+        if (l < 0 || l >= (int)layers.size() || !layers[l].in_use || layers[l].indexed || renderer == NULL)
+            return nullptr;
+        graphic_layer& gl = layers[l];
+        gl.empty = false;
+        gl.last_drawn = elapsed_frames;
+        if (gl.texture == nullptr)
+        {
+            // World layers cover the wrapped world, screen layers cover the screen
+            int w = gl.world ? render_w * 2 : render_w;
+            int h = gl.world ? render_h * 2 : render_h;
+            gl.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, w, h);
+            SDL_SetRenderTarget(renderer, gl.texture);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+            SDL_RenderClear(renderer);
+            if (gl.world)
+                SDL_SetRenderScale(renderer, render_scale, render_scale);
+            return gl.texture;
+        }
+        SDL_SetRenderTarget(renderer, gl.texture);
+        return gl.texture;
     }
 
-    // Play a sound on a channel
-    // int audio_index : Integer index to where the sound is stored
-    // int channel : Integer channel index to play the sound at the index on
-    // bool loop : Whether the sound should loop or not
-    void PlaySoundOnChannel(int audio_index, int channel, bool loop = false)
+    // Get the camera offset of a viewport
+    // int id : Viewport index
+    // float* x : Pointer to store the horizontal camera offset
+    // float* y : Pointer to store the vertical camera offset
+    void GetViewportCamera(int id, float* x, float* y)
     {
-        channel = channel % audio_channels.size();
-        audio_channels[channel]->PlaySound(global_audio_spec, sounds[audio_index], loop);
+        *x = id == 0 ? cam_offset_x : viewports[id].cam_x;
+        *y = id == 0 ? cam_offset_y : viewports[id].cam_y;
     }
 
-    // Bind a synth to a channel
-    // int audio_index : Integer index to where the sound is stored
-    // int channel : Integer channel index to play the sound at the index on
-    // bool loop : Whether the sound should loop or not
-    void BindSynthToChannel(GravityEngine_Synth* s, int channel)
+    // Composite a world-space texture into one viewport of the output, wrapping the camera window around the edges of the world
+    // SDL_Texture* texture : Texture to composite
+    // float texel_x : Horizontal texels per logical pixel
+    // float texel_y : Vertical texels per logical pixel
+    // float cam_x : Horizontal camera offset into the world (after parallax)
+    // float cam_y : Vertical camera offset into the world (after parallax)
+    // SDL_FRect view : Screen rectangle of the viewport in drawing units
+    // SDL_FRect out : Output rectangle the screen maps to
+    // float lw : Logical width the texture wraps at (0 = the world)
+    // float lh : Logical height the texture wraps at (0 = the world)
+    void CompositeWorldLayer(SDL_Texture* texture, float texel_x, float texel_y, float cam_x, float cam_y, SDL_FRect view, SDL_FRect out, float lw = 0, float lh = 0)
     {
-        channel = channel % audio_channels.size();
-        audio_channels[channel]->PlaySynth(&global_audio_spec, s);
+        // Logical size of the world and the camera offset into it
+        if (lw == 0)
+            lw = render_w * 2;
+        if (lh == 0)
+            lh = render_h * 2;
+        float ox = fmod(cam_x, lw);
+        float oy = fmod(cam_y, lh);
+        if (ox < 0)
+            ox += lw;
+        if (oy < 0)
+            oy += lh;
+        // Output pixels per logical pixel
+        float fx = out.w / render_w;
+        float fy = out.h / render_h;
+        // A window no larger than the screen crosses at most one edge per axis, so it splits into at most four pieces
+        float dy = 0;
+        while (dy < view.h)
+        {
+            float sy = fmod(oy + dy, lh);
+            float ph = std::min(view.h - dy, lh - sy);
+            float dx = 0;
+            while (dx < view.w)
+            {
+                float sx = fmod(ox + dx, lw);
+                float pw = std::min(view.w - dx, lw - sx);
+                SDL_FRect s_rect = { sx * texel_x, sy * texel_y, pw * texel_x, ph * texel_y };
+                SDL_FRect d_rect = { out.x + (view.x + dx) * fx, out.y + (view.y + dy) * fy, pw * fx, ph * fy };
+                SDL_RenderTexture(renderer, texture, &s_rect, &d_rect);
+                dx += pw;
+            }
+            dy += ph;
+        }
     }
 
-    // Pause channel
-    // int channel : Integer channel index
-    void PauseChannel(int channel)
+    // Get the part of a viewport that is on screen. Returns false if the viewport is removed or fully off screen
+    // int v : Viewport index
+    // SDL_FRect* view : Pointer to store the on-screen rectangle in drawing units
+    bool GetViewportOnScreen(int v, SDL_FRect* view)
     {
-        audio_channels[channel]->PausePlayback();
+        SDL_FRect screen = { 0, 0, (float)render_w, (float)render_h };
+        return viewports[v].in_use && SDL_GetRectIntersectionFloat(&viewports[v].rect, &screen, view);
     }
 
-    // Resume channel
-    // int channel : Integer channel index
-    void ResumeChannel(int channel)
+    // Composite a world-space texture into one viewport
+    // int v : Viewport index
+    // SDL_Texture* texture : Texture to composite
+    // float texel_x : Horizontal texels per logical pixel
+    // float texel_y : Vertical texels per logical pixel
+    // float parallax_x : Horizontal camera follow factor
+    // float parallax_y : Vertical camera follow factor
+    // SDL_FRect out : Output rectangle the screen maps to
+    void CompositeWorldView(int v, SDL_Texture* texture, float texel_x, float texel_y, float parallax_x, float parallax_y, SDL_FRect out)
     {
-        audio_channels[channel]->ResumePlayback();
+        SDL_FRect view;
+        if (!GetViewportOnScreen(v, &view))
+            return;
+        float cam_x, cam_y;
+        GetViewportCamera(v, &cam_x, &cam_y);
+        // Keep the part of the world that lines up with the clipped rectangle (a screen offset, so it is added after parallax)
+        cam_x = cam_x * parallax_x + view.x - viewports[v].rect.x;
+        cam_y = cam_y * parallax_y + view.y - viewports[v].rect.y;
+        CompositeWorldLayer(texture, texel_x, texel_y, cam_x, cam_y, view, out);
     }
 
-    // Stop channel
-    // int channel : Integer channel index
-    void StopChannel(int channel)
+    // Composite the layer stack in z order as seen through one viewport
+    // int v : Viewport index (-1 = only the screen layers, for the parts of the screen no viewport covers)
+    // SDL_FRect out : Output rectangle the screen maps to
+    void CompositeLayers(int v, SDL_FRect out)
     {
-        audio_channels[channel]->StopPlayback();
+        bool lighting = lighting_enabled && light_texture != nullptr && v >= 0;
+        bool in_lit = false;
+        for (int i : layer_order)
+        {
+            graphic_layer& gl = layers[i];
+            // Indexed layers are expanded for the visible window only, then drawn like a screen layer
+            if (gl.indexed && gl.visible && !gl.indices.empty())
+                ExpandIndexedLayer(gl);
+            // Layers that were never drawn to have no texture and cost nothing
+            if (!gl.visible || gl.texture == nullptr || gl.opacity <= 0 || (v < 0 && gl.world))
+                continue;
+            // Each run of lit layers is composited on its own so the light map only darkens those layers
+            if (lighting && gl.lit && !in_lit)
+                in_lit = BeginLitLayers(out);
+            else if (in_lit && !gl.lit)
+                in_lit = EndLitLayers(v, out);
+            SDL_SetTextureBlendMode(gl.texture, gl.blend_mode);
+            SDL_SetTextureAlphaModFloat(gl.texture, gl.opacity);
+            if (gl.world && !gl.indexed)
+            {
+                CompositeWorldView(v, gl.texture, render_scale, render_scale, gl.parallax_x, gl.parallax_y, out);
+            }
+            else if (gl.ring)
+            {
+                // The ring starts wherever the scroll position lands in it
+                CompositeWorldLayer(gl.texture, 1, 1, gl.ring_x, gl.ring_y, { 0, 0, (float)render_w, (float)render_h }, out, render_w, render_h);
+            }
+            else
+            {
+                SDL_FRect s_rect = { 0, 0, (float)gl.texture->w, (float)gl.texture->h };
+                SDL_RenderTexture(renderer, gl.texture, &s_rect, &out);
+            }
+        }
+        if (in_lit)
+            EndLitLayers(v, out);
     }
 
-    // Cancel channel's looping status
-    // int channel : Integer channel index
-    void CancelChannelLoop(int channel)
+    // Switch compositing to the lit layer target, keeping the clip rectangle of the output. Returns true if it was switched
+    // SDL_FRect out : Output rectangle the screen maps to
+    bool BeginLitLayers(SDL_FRect out)
     {
-        audio_channels[channel]->CancelLoop();
+        if (lit_texture != nullptr && (lit_texture->w != (int)out.w || lit_texture->h != (int)out.h))
+        {
+            SDL_DestroyTexture(lit_texture);
+            lit_texture = nullptr;
+        }
+        if (lit_texture == nullptr)
+        {
+            lit_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, (int)out.w, (int)out.h);
+            if (lit_texture == nullptr)
+                return false;
+            // Colors in the target end up premultiplied by alpha
+            SDL_SetTextureBlendMode(lit_texture, SDL_BLENDMODE_BLEND_PREMULTIPLIED);
+        }
+        lit_output = SDL_GetRenderTarget(renderer);
+        SDL_Rect clip;
+        bool clipped = SDL_RenderClipEnabled(renderer) && SDL_GetRenderClipRect(renderer, &clip);
+        SDL_SetRenderTarget(renderer, lit_texture);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+        SDL_SetRenderClipRect(renderer, clipped ? &clip : NULL);
+        return true;
     }
 
-private:
+    // Blend the light map over the lit layer target and composite it into the output. Always returns false (no longer in a lit run)
+    // int v : Viewport index
+    // SDL_FRect out : Output rectangle the screen maps to
+    bool EndLitLayers(int v, SDL_FRect out)
+    {
+        CompositeLightMap(v, out);
+        SDL_Rect clip;
+        bool clipped = SDL_RenderClipEnabled(renderer) && SDL_GetRenderClipRect(renderer, &clip);
+        SDL_SetRenderTarget(renderer, lit_output);
+        SDL_SetRenderClipRect(renderer, clipped ? &clip : NULL);
+        SDL_RenderTexture(renderer, lit_texture, NULL, &out);
+        return false;
+    }
 
     // Draw screen buffer to the SDL window
+    // All layers are composited in z order straight to the output, one viewport at a time
     void DrawScreen()
     {
-        // Render all layers to the render_texture
-        if (screen_updated)
+        if (!screen_updated)
+            return;
+
+        // The terminal only shows the character grid
+        if (backend == ansi_terminal)
         {
-            // Define where the layer will go in a rect
-            for (int q = 0; q <= 1; q++)
-            {
-                for (int i = 0; i <= 1; i++)
-                {
-                    SDL_FRect c_rect;
-                    c_rect.x = scr_w * i * 2;
-                    c_rect.y = scr_h * q * 2;
-                    c_rect.w = scr_w * 2;
-                    c_rect.h = scr_h * 2;
-                    SDL_FRect s_rect;
-                    s_rect.x = 0;
-                    s_rect.y = 0;
-                    s_rect.w = scr_w * 2;
-                    s_rect.h = scr_h * 2;
-                    // Render to texture instead of directly to the screen
-                    SDL_SetRenderTarget(renderer, render_texture);
-                    // Draw the background text texture to the renderer
-                    SDL_RenderTexture(renderer, p_background_texture, new SDL_FRect(s_rect), new SDL_FRect(c_rect));
-                    // Draw the background text texture to the renderer
-                    SDL_RenderTexture(renderer, p_entity_texture, new SDL_FRect(s_rect), new SDL_FRect(c_rect));
-                    // Draw the foreground text texture to the renderer
-                    SDL_RenderTexture(renderer, p_foreground_texture, new SDL_FRect(s_rect), new SDL_FRect(c_rect));
-                }
-            }
+            PresentTerminal();
+            return;
+        }
 
-            SDL_FRect d_rect;
-            d_rect.x = 0;
-            d_rect.y = 0;
-            d_rect.w = scr_w;
-            d_rect.h = scr_h;
-            SDL_FRect t_rect;
-            t_rect.x = 0;
-            t_rect.y = 0;
-            t_rect.w = scr_w;
-            t_rect.h = scr_h;
-            // Render to texture instead of directly to the screen
-            SDL_SetRenderTarget(renderer, render_texture_ui);
-            // Draw the ui text texture to the renderer
-            SDL_RenderTexture(renderer, p_ui_texture, new SDL_FRect(t_rect), new SDL_FRect(d_rect));
-            // Draw the debug text texture to the renderer
-            SDL_RenderTexture(renderer, p_debug_texture, new SDL_FRect(t_rect), new SDL_FRect(d_rect));
-        }
-
-        // Reset render back to screen
-        SDL_SetRenderTarget(renderer, NULL);
+        // Draw everything still queued on the layers
+        for (auto& gl : layers)
+            FlushLayer(gl);
+
+        // Composite into the window, or into the internal resolution frame when low_res is on
+        SDL_FRect out = { 0, 0, (float)render_w, (float)render_h };
+        if (low_res)
+        {
+            SDL_SetRenderTarget(renderer, present_texture);
+        }
+        else
+        {
+            int out_w, out_h;
+            SDL_SetRenderTarget(renderer, NULL);
+            SDL_GetCurrentRenderOutputSize(renderer, &out_w, &out_h);
+            out.w = out_w;
+            out.h = out_h;
+        }
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+
+        // Parts of the screen outside every viewport only show the screen layers
+        SDL_FRect screen = { 0, 0, (float)render_w, (float)render_h };
+        bool covered = false;
+        for (int v = 0; v < (int)viewports.size(); v++)
+        {
+            SDL_FRect view;
+            if (GetViewportOnScreen(v, &view) && SDL_RectsEqualFloat(&view, &screen))
+                covered = true;
+        }
+        if (!covered)
+            CompositeLayers(-1, out);
+
+        // Each viewport gets the whole stack clipped to its rectangle, so a view drawn over another covers every layer under it
+        float fx = out.w / render_w;
+        float fy = out.h / render_h;
+        SDL_BlendMode old_mode;
+        SDL_GetRenderDrawBlendMode(renderer, &old_mode);
+        for (int v = 0; v < (int)viewports.size(); v++)
+        {
+            SDL_FRect view;
+            if (!GetViewportOnScreen(v, &view))
+                continue;
+            SDL_FRect clip_f = { out.x + view.x * fx, out.y + view.y * fy, view.w * fx, view.h * fy };
+            SDL_Rect clip = { (int)floor(clip_f.x), (int)floor(clip_f.y), (int)ceil(clip_f.x + clip_f.w) - (int)floor(clip_f.x), (int)ceil(clip_f.y + clip_f.h) - (int)floor(clip_f.y) };
+            SDL_SetRenderClipRect(renderer, &clip);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+            SDL_RenderFillRect(renderer, &clip_f);
+            SDL_SetRenderDrawBlendMode(renderer, old_mode);
+            CompositeLayers(v, out);
+        }
+        SDL_SetRenderClipRect(renderer, NULL);
+
+        // Upscale the internal resolution frame to the window
+        if (low_res)
+        {
+            SDL_SetRenderTarget(renderer, NULL);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
+            SDL_RenderTexture(renderer, present_texture, NULL, GetPresentRect());
+        }
     }
 
     // Pre-game code
@@ -979,8 +6189,19 @@ private:
         // Clear surface
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 
+        // Bring the scrolling layers, light map, minimap and retained UI up to date
+        UpdateScrollingLayers();
+        UpdateLighting();
+        UpdateMinimap();
+        UpdateDistanceField();
+        UpdatePaths();
+        UpdateFlowFields();
+        UpdateUI();
+
         // Draw visuals
+        auto composite_start = std::chrono::steady_clock::now();
         DrawScreen();
+        composite_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - composite_start).count();
     }
 
     // Post-game code
@@ -991,58 +6212,67 @@ private:
 
         // Mod
         if (cam_offset_x <= 0)
-            cam_offset_x += scr_w * 2;
-        if (cam_offset_x >= scr_w * 2)
-            cam_offset_x -= scr_w * 2;
+            cam_offset_x += render_w * 2;
+        if (cam_offset_x >= render_w * 2)
+            cam_offset_x -= render_w * 2;
         if (cam_offset_y <= 0)
-            cam_offset_y += scr_h * 2;
-        if (cam_offset_y >= scr_h * 2)
-            cam_offset_y -= scr_h * 2;
+            cam_offset_y += render_h * 2;
+        if (cam_offset_y >= render_h * 2)
+            cam_offset_y -= render_h * 2;
 
         // Draw to the window - Do not draw if the draw flag is off
-        if (screen_updated)
-        {
-            SDL_FRect d_rect;
-            d_rect.x = 0;
-            d_rect.y = 0;
-            d_rect.w = scr_w;
-            d_rect.h = scr_h;
-            SDL_FRect s_rect;
-            s_rect.x = cam_offset_x;
-            s_rect.y = cam_offset_y;
-            s_rect.w = scr_w;
-            s_rect.h = scr_h;
-            // Draw the screen texture to the renderer
-            SDL_RenderTexture(renderer, render_texture, &s_rect, NULL);
-            SDL_RenderTexture(renderer, render_texture_ui, &d_rect, NULL);
+        auto present_start = std::chrono::steady_clock::now();
+        if (screen_updated && backend == sdl_window)
+        {
+            SDL_SetRenderTarget(renderer, NULL);
             SDL_RenderPresent(renderer);
             // I dunno why I have this delay here
             SDL_Delay(0);
             // Reset the draw flag
             screen_updated = false;
-            // Clear output
-            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-            SDL_RenderClear(renderer);
+        }
+        else if (backend == ansi_terminal)
+        {
+            screen_updated = false;
         }
 
-        // Clear the Dynamic Collision values
-        for (int i = 0; i < canvas_h * 2; i++)
+        // Log the compositing time and let the dynamic resolution controller react to it
+        composite_time += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - present_start).count();
+        UpdateDynamicResolution();
+
+        // Clear the Dynamic Collision values - Only the spans written this frame
+        ClearDynamicSpans();
+
+        // Clear the pixel layers that are redrawn every frame (entity and debug by default)
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        for (auto& gl : layers)
         {
-            for (int q = 0; q < canvas_w * 2; q++)
+            if (gl.in_use && gl.clear_each_frame)
+                std::fill(gl.cells.begin(), gl.cells.end(), char_cell());
+            if (gl.in_use && gl.clear_each_frame && gl.indexed)
+            {
+                std::fill(gl.indices.begin(), gl.indices.end(), 0);
+                gl.indexed_dirty = true;
+            }
+            else if (gl.in_use && gl.clear_each_frame && gl.texture != nullptr && !gl.empty)
+            {
+                gl.batch_vertices.clear();
+                gl.batch_indices.clear();
+                gl.batch_glyphs.clear();
+                SDL_SetRenderTarget(renderer, gl.texture);
+                SDL_RenderClear(renderer);
+                gl.empty = true;
+            }
+            // Free the texture of a layer that is empty and has not been drawn on for a while - It comes back on the next draw
+            // Indexed layers keep theirs, since their texture is only rebuilt when the indices change
+            if (gl.texture != nullptr && !gl.indexed && gl.empty && layer_release_frames > 0 && elapsed_frames - gl.last_drawn > layer_release_frames)
             {
-                SetCollisionValue(q, i, dyn, 0);
+                SDL_DestroyTexture(gl.texture);
+                gl.texture = nullptr;
+                gl.ring_valid = false;
             }
         }
 
-        // Clear the Entity and Debug pixel layers
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-        SDL_SetRenderTarget(renderer, p_debug_texture);
-        SDL_RenderClear(renderer);
-        SDL_SetRenderTarget(renderer, p_entity_texture);
-        SDL_RenderClear(renderer);
-        SDL_SetRenderTarget(renderer, render_texture_ui);
-        SDL_RenderClear(renderer);
-
         // Call all step functions
         for (auto o : entity_list)
             (*o).end_step();
@@ -1072,7 +6302,12 @@ private:
         if (debug_complex)
         {
             std::cout << "DELTA TIME: " + std::to_string(DeltaTime()) + " ELAPSED SECONDS: " + std::to_string(seconds) + " ELAPSED FRAMES: " + std::to_string(elapsed_frames) + "\n"
-                << "FRAME TIME: " + std::to_string(frame_time) + " FPS: " + std::to_string(*frames_per_second) + "\n";
+                << "FRAME TIME: " + std::to_string(frame_time) + " FPS: " + std::to_string(*frames_per_second) + "\n"
+                << "COMPOSITE TIME: " + std::to_string(composite_time) + " RENDER SCALE: " + std::to_string(render_scale) + "\n"
+                << "SPRITE MEMORY: " + std::to_string(sprite_memory_used) + " BYTES\n";
+            for (int i = 0; i < (int)sprite_list.size(); i++)
+                if (sprite_list[i].texture != nullptr)
+                    std::cout << "  SPRITE " + std::to_string(i) + " " + sprite_list[i].path + ": " + std::to_string(sprite_list[i].bytes) + " BYTES, " + std::to_string(sprite_list[i].ref_count) + " REFS\n";
         }
         else
         {
@@ -1144,6 +6379,6 @@ private:
 // std::vector<T> v : The vector to check
 // T val : The value to check the presence of
 template <typename T> bool
-VectorContains(std::vector<T> v, T val) {
+VectorContains(const std::vector<T>& v, T val) {
     return std::find(v.begin(), v.end(), val) != v.end();
 }
\ No newline at end of file